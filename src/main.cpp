@@ -6,37 +6,40 @@ int main(int argc, char **argv) {
     // Start timer after accepting settings
     time_t start_time = time(NULL);
 
-    std::vector<cv::Mat> images = {};
-    const std::vector<std::string> input_paths = conf.get_input_paths();
-    const std::vector<std::string> input_types = conf.get_input_types();
-
-    for (size_t i = 0; i < input_paths.size(); i++) {
-        if (input_types[i] == "pdf") {
-            add_pdf_images(input_paths[i], images, conf);
-        } else if (input_types[i] == "dir") {
-            add_dir_images(input_paths[i], images, conf);
-        }
+    // Timeline is known from page sizes alone
+    Plan plan = build_plan(conf);
+    if (conf.get_is_dry_run()) {
+        print_plan(plan, conf);
+        return 0;
     }
 
-    // Initializing video renderer
-    std::string codec = conf.get_codec();
-    cv::Size frame_size(conf.get_width(), conf.get_height());
-    cv::VideoWriter video = cv::VideoWriter(conf.get_output(), cv::CAP_FFMPEG, cv::VideoWriter::fourcc(codec[0], codec[1], codec[2], codec[3]), conf.get_fps(), frame_size, true);
+    // Pages and images from every input load in parallel, correcting the plan to what loaded
+    std::vector<cv::Mat> images = load_plan_images(plan, conf);
+    if (images.size() == 0) {
+        std::cerr << "<!> No images were loaded." << std::endl;
+        exit(1);
+    }
+
+    // Initializing video renderer, one encoder per rendition
+    VideoOutput video(conf);
 
     if (conf.get_style() == FRAMES) {
         render_video_sequence(video, images, conf);
     } else if (conf.get_style() == UP ) {
-        render_video_scroll_up(video, images, conf);
+        render_video_scroll_up(video, images, plan, conf);
     } else if (conf.get_style() == DOWN) {
-        // render_video_scroll_down(video, images, conf);
+        // render_video_scroll_down(video, images, plan, conf);
     } else if (conf.get_style() == LEFT) {
-        render_video_scroll_left(video, images, conf);
+        render_video_scroll_left(video, images, plan, conf);
     } else if (conf.get_style() == RIGHT) {
-        // render_video_scroll_right(video, images, conf);
+        // render_video_scroll_right(video, images, plan, conf);
+    } else if (conf.get_style() == KENBURNS) {
+        render_video_ken_burns(video, images, plan, conf);
     }
 
     // Finish Video
     video.release();
+    print_pipeline_stalls(video.get_compositor_stall(), video.get_encoder_stall());
 
     // Clean Up
     for (auto &img : images) {
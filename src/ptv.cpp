@@ -1,26 +1,46 @@
 #include "ptv.hpp"
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <deque>
 #include <filesystem>
+#include <fstream>
 #include <iomanip>
+#include <string_view>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
 
 Config::Config(int argc, char **argv) :
 render_gifs_(false),
 is_reverse_(false),
+is_dry_run_(false),
+use_passthrough_(true),
+is_trim_(false),
 width_(1280),
 height_(720),
 fps_(1.0f),
 spp_(1.0f),
 duration_(0.0f),
+segment_seconds_(0.0f),
 style_(FRAMES),
 output_(""),
 container_(".mp4"),
 codec_("avc1"),
 input_paths_({}),
-input_types_({}) {
+input_types_({}),
+ladder_({}) {
     if (argc < 2) {
         std::cout << HELP_TXT << std::endl;
         exit(1);
     }
 
+    // Each -r pairs with the -o at the same position
+    std::vector<cv::Size> resolutions;
+    std::vector<std::string> outputs;
+
     // Update Default Settings
     for (int i = 1; i < argc; i++) {
         std::string arg = std::string(argv[i]);
@@ -58,14 +78,13 @@ input_types_({}) {
             if ((int)currArg.size() < 3) {
                 std::cerr << "<!> Error: '" << argv[i] << "' is not valid input for '-r'. Correct: 0x0 or 1920x1080 or 0x720" << std::endl;
             }
-            width_ = std::stoi(currArg.substr(0, currArg.find('x')));
-            height_ = std::stoi(currArg.substr(currArg.find('x') + 1));
-            set_width(width_);
-            set_height(height_);
-            if (width_ < 0 || height_ < 0) {
+            int w = std::stoi(currArg.substr(0, currArg.find('x')));
+            int h = std::stoi(currArg.substr(currArg.find('x') + 1));
+            if (w < 0 || h < 0) {
                 std::cerr << "<!> Resolution input cannot be negative." << std::endl;
                 exit(1);
             }
+            resolutions.push_back(cv::Size(w, h));
         } else if (arg == "-f") {
             i++;
             fps_ = std::stof(argv[i]);
@@ -89,10 +108,17 @@ input_types_({}) {
                 std::cerr << "<!> Error: Output file cannot be a directory." << std::endl;
                 exit(1);
             }
-            if ((int)arg.find(container_) == -1) {
-                output_ = arg + container_;
+            if ((int)arg.find(container_) == -1 && (int)arg.find(HLS_PLAYLIST) == -1) {
+                outputs.push_back(arg + container_);
             } else {
-                output_ = arg;
+                outputs.push_back(arg);
+            }
+        } else if (arg == "--hls") {
+            i++;
+            segment_seconds_ = std::stof(argv[i]);
+            if (segment_seconds_ <= 0) {
+                std::cerr << "<!> Error: '--hls' segment length must be greater than 0." << std::endl;
+                exit(1);
             }
         } else if (arg == "-a") {
             i++;
@@ -100,8 +126,8 @@ input_types_({}) {
             for (size_t i = 0; i < a.size(); i++) {
                 a[i] = toupper(a[i]);
             }
-            if (a != UP && a != DOWN && a != LEFT && a != RIGHT) {
-                std::cerr << "<!> Invalid input for '-a'. Must be [Up|Down|Left|Right]" << std::endl;
+            if (a != UP && a != DOWN && a != LEFT && a != RIGHT && a != KENBURNS) {
+                std::cerr << "<!> Invalid input for '-a'. Must be [Up|Down|Left|Right|KenBurns]" << std::endl;
                 exit(1);
             }
             style_ = a;
@@ -109,6 +135,12 @@ input_types_({}) {
             render_gifs_ = true;
         } else if (arg == "--rev-seq") {
             is_reverse_ = true;
+        } else if (arg == "--dry-run") {
+            is_dry_run_ = true;
+        } else if (arg == "--no-passthrough") {
+            use_passthrough_ = false;
+        } else if (arg == "--trim") {
+            is_trim_ = true;
         } else {
             std::cerr << "<!> Unknown argument detected: " << argv[i] << std::endl;
             exit(1);
@@ -132,16 +164,91 @@ input_types_({}) {
     }
     std::cout << "\n";
 
-    if (output_ == "" && input_types_[0] == "pdf") {
+    // A .m3u8 output implies hls, and hls turns every output into a playlist
+    for (const std::string &out : outputs) {
+        if (out.size() > 5 && out.substr(out.size() - 5) == HLS_PLAYLIST && segment_seconds_ == 0) {
+            segment_seconds_ = HLS_SEGMENT_SECONDS;
+        }
+    }
+    if (segment_seconds_ > 0) {
+        for (std::string &out : outputs) {
+            if (out.size() > container_.size() && out.substr(out.size() - container_.size()) == container_) {
+                out = out.substr(0, out.size() - container_.size()) + HLS_PLAYLIST;
+            }
+        }
+        container_ = HLS_PLAYLIST;
+    }
+
+    std::string auto_stem;
+    if (input_types_[0] == "pdf") {
         std::string path = input_paths_[0];
-        output_ = path.substr(0, path.find_last_of('.')) + container_;
-    } else if (output_ == "" && input_types_[0] == "dir") {
+        auto_stem = path.substr(0, path.find_last_of('.'));
+    } else if (input_types_[0] == "dir") {
         std::string path = input_paths_[0];
-        output_ = path.substr(0, path.find_last_of('/')) + container_;
+        auto_stem = path.substr(0, path.find_last_of('/'));
+    }
+
+    // Builds rendition ladder, largest first
+    if (resolutions.size() == 0) {
+        resolutions.push_back(cv::Size(width_, height_));
+    }
+    if (outputs.size() > resolutions.size()) {
+        std::cerr << "<!> Error: Each '-o' needs a matching '-r' when rendering multiple resolutions." << std::endl;
+        exit(1);
+    }
+    std::vector<Rendition> renditions;
+    for (size_t r = 0; r < resolutions.size(); r++) {
+        Rendition rend;
+        rend.width = resolutions[r].width % 2 == 0 ? resolutions[r].width : resolutions[r].width + 1;
+        rend.height = resolutions[r].height % 2 == 0 ? resolutions[r].height : resolutions[r].height + 1;
+        if (r < outputs.size()) {
+            rend.output = outputs[r];
+        } else if (resolutions.size() == 1) {
+            rend.output = auto_stem + container_;
+        } else {
+            rend.output = auto_stem + "_" + std::to_string(rend.height) + "p" + container_;
+        }
+        renditions.push_back(rend);
+    }
+    std::stable_sort(renditions.begin(), renditions.end(), [](const Rendition &a, const Rendition &b) {
+        return (long)a.width * a.height > (long)b.width * b.height;
+    });
+    for (size_t r = 1; r < renditions.size(); r++) {
+        const Rendition &top = renditions[0];
+        const Rendition &rend = renditions[r];
+        if (top.width == 0 || top.height == 0 || rend.width == 0 || rend.height == 0) {
+            std::cerr << "<!> Error: A resolution of 0 can only be used with a single '-r'." << std::endl;
+            exit(1);
+        }
+        if (rend.width > top.width || rend.height > top.height
+            || std::abs((double)rend.width / rend.height - (double)top.width / top.height) > 0.01 * ((double)top.width / top.height)) {
+            std::cerr << "<!> Error: " << rend.width << "x" << rend.height << " must have the same aspect ratio as " << top.width << "x" << top.height << "." << std::endl;
+            exit(1);
+        }
+        for (size_t o = 0; o < r; o++) {
+            if (renditions[o].output == rend.output) {
+                std::cerr << "<!> Error: '" << rend.output << "' is used for more than one resolution." << std::endl;
+                exit(1);
+            }
+        }
     }
+    width_ = renditions[0].width;
+    height_ = renditions[0].height;
+    output_ = renditions[0].output;
+    ladder_.assign(renditions.begin() + 1, renditions.end());
 
     std::cout << std::left << std::setw(gap) << "  Output" << output_ << "\n";
     std::cout << std::left << std::setw(gap) << "  Resolution" << width_ << "x" << height_ << "\n";
+    for (const Rendition &rend : ladder_) {
+        std::cout << std::left << std::setw(gap) << "  + Rendition" << rend.width << "x" << rend.height << " " << COLOR_DIM << rend.output << COLOR_RESET << "\n";
+    }
+    if (segment_seconds_ > 0) {
+        std::cout << std::left << std::setw(gap) << "  HLS" << segment_seconds_ << "s segments";
+        if (ladder_.size() > 0) {
+            std::cout << ", master " << COLOR_DIM << get_master_playlist_path(output_) << COLOR_RESET;
+        }
+        std::cout << "\n";
+    }
     std::cout << std::left << std::setw(gap) << "  FPS" << fps_ << "\n";
     if (duration_ != 0 && style_ != FRAMES) {
         std::cout << std::left << std::setw(gap) << "  Duration" << duration_ << "s\n";
@@ -150,6 +257,11 @@ input_types_({}) {
     }
     std::cout << std::left << std::setw(gap) << "  Animation" << style_ << "\n";
 
+    // Nothing gets written on a dry run
+    if (is_dry_run_) {
+        return;
+    }
+
     // User Confirm Setttings
     std::string check;
     std::cout << "\n" << COLOR_BOLD << "Proceed? [Y/n] " << COLOR_RESET;
@@ -181,16 +293,207 @@ void Config::set_resolution(poppler::rectf rect) {
 // Getters
 bool Config::get_render_gifs() { return render_gifs_; }
 bool Config::get_is_reverse() { return is_reverse_; }
+bool Config::get_is_dry_run() { return is_dry_run_; }
+bool Config::get_use_passthrough() { return use_passthrough_; }
+bool Config::get_trim() { return is_trim_; }
 int Config::get_width() { return width_; }
 int Config::get_height() { return height_; }
 float Config::get_fps() { return fps_; }
 float Config::get_spp() { return spp_; }
 float Config::get_duration() { return  duration_; }
+float Config::get_segment_seconds() { return segment_seconds_; }
 std::string Config::get_style() { return style_; }
 std::string Config::get_output() { return output_; }
 std::string Config::get_codec() { return codec_; }
 std::vector<std::string> Config::get_input_paths() { return input_paths_; }
 std::vector<std::string> Config::get_input_types() { return input_types_; }
+std::vector<Rendition> Config::get_renditions() {
+    std::vector<Rendition> renditions = {{width_, height_, output_}};
+    renditions.insert(renditions.end(), ladder_.begin(), ladder_.end());
+    return renditions;
+}
+
+VideoOutput::VideoOutput(Config &conf) :
+renditions_(conf.get_renditions()),
+writers_({}),
+fourcc_(0),
+fps_(conf.get_fps()),
+segment_frames_(0),
+frame_count_(0),
+scans_({}),
+frames_({}),
+ring_({}),
+head_(0),
+tail_(0),
+count_(0),
+is_done_(false),
+compositor_stall_(0.0),
+encoder_stall_(0.0) {
+    std::string codec = conf.get_codec();
+    fourcc_ = cv::VideoWriter::fourcc(codec[0], codec[1], codec[2], codec[3]);
+    if (conf.get_segment_seconds() > 0) {
+        segment_frames_ = std::max(1, (int)std::round(conf.get_segment_seconds() * fps_));
+        scans_.resize(renditions_.size());
+        // Empty playlists up front, so the master never points at a missing file
+        for (const Rendition &rend : renditions_) {
+            write_media_playlist(rend.output, {}, get_target_duration(), false);
+        }
+        if (renditions_.size() > 1) {
+            write_master_playlist(get_master_playlist_path(renditions_[0].output), renditions_, fps_);
+        }
+    }
+    writers_.resize(renditions_.size());
+    for (size_t i = 0; i < renditions_.size(); i++) {
+        open_writer(i);
+    }
+    frames_.resize(renditions_.size());
+    for (int i = 0; i < FRAME_RING_SIZE; i++) {
+        ring_.push_back(cv::Mat(renditions_[0].height, renditions_[0].width, CV_8UC3, cv::Scalar(0, 0, 0)));
+    }
+    encoder_ = std::thread(&VideoOutput::encode_loop, this);
+}
+
+VideoOutput::~VideoOutput() {
+    if (encoder_.joinable()) {
+        release();
+    }
+}
+
+cv::Mat &VideoOutput::acquire_frame() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (count_ == ring_.size()) {
+        auto start = std::chrono::steady_clock::now();
+        not_full_.wait(lock, [this] { return count_ < ring_.size(); });
+        compositor_stall_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    return ring_[head_];
+}
+
+void VideoOutput::submit_frame() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        head_ = (head_ + 1) % ring_.size();
+        count_++;
+    }
+    not_empty_.notify_one();
+}
+
+void VideoOutput::encode_loop() {
+    while (true) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (count_ == 0 && !is_done_) {
+            auto start = std::chrono::steady_clock::now();
+            not_empty_.wait(lock, [this] { return count_ > 0 || is_done_; });
+            encoder_stall_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+        if (count_ == 0) {
+            return;
+        }
+        // The compositor never touches submitted slots, so encoding runs unlocked
+        cv::Mat &frame = ring_[tail_];
+        lock.unlock();
+
+        encode(frame);
+
+        lock.lock();
+        tail_ = (tail_ + 1) % ring_.size();
+        count_--;
+        lock.unlock();
+        not_full_.notify_one();
+    }
+}
+
+// Opens the rendition's file, its .ts stream when writing hls.
+// Only called from the constructor, so a failure exits before the encoder thread starts.
+void VideoOutput::open_writer(const size_t rendition) {
+    const Rendition &rend = renditions_[rendition];
+    std::string path = rend.output;
+    if (segment_frames_ > 0) {
+        path = get_stream_path(rend.output);
+    }
+    writers_[rendition].open(path, cv::CAP_FFMPEG, fourcc_, fps_, cv::Size(rend.width, rend.height), true);
+    if (!writers_[rendition].isOpened()) {
+        std::cerr << "<!> Error: Could not open '" << path << "' for writing." << std::endl;
+        exit(1);
+    }
+}
+
+// Lists whatever follows the last keyframe boundary as the final segment, once the writers have flushed
+void VideoOutput::finish_segments() {
+    for (size_t i = 0; i < renditions_.size(); i++) {
+        const std::string stream_path = get_stream_path(renditions_[i].output);
+        TsScan &scan = scans_[i];
+        if (frame_count_ == 0) {
+            std::filesystem::remove(stream_path);
+        } else {
+            scan_ts_segments(stream_path, scan, segment_frames_, fps_);
+            if (scan.frames > scan.segment_frame) {
+                scan.segments.push_back({scan.segment_offset, scan.offset - scan.segment_offset, (scan.frames - scan.segment_frame) / fps_});
+            }
+        }
+        write_media_playlist(renditions_[i].output, scan.segments, get_target_duration(), true);
+    }
+}
+
+// Segments close on the first keyframe after segment_frames_, and keyframes are at most
+// HLS_GOP_FRAMES apart, rounded up to whole seconds as hls requires
+int VideoOutput::get_target_duration() {
+    return std::max(1, (int)std::ceil((segment_frames_ + HLS_GOP_FRAMES - 1) / fps_));
+}
+
+void VideoOutput::encode(const cv::Mat &frame) {
+    // Downscales from the previous rendition instead of the full frame, so each step stays cheap
+    frames_[0] = frame;
+    for (size_t i = 1; i < renditions_.size(); i++) {
+        cv::resize(frames_[i - 1], frames_[i], cv::Size(renditions_[i].width, renditions_[i].height), 0, 0, cv::INTER_AREA);
+    }
+
+    // Encoders are independent, so renditions encode concurrently
+    if (writers_.size() == 1) {
+        writers_[0].write(frames_[0]);
+    } else {
+        cv::parallel_for_(cv::Range(0, (int)writers_.size()), [&](const cv::Range &range) {
+            for (int i = range.start; i < range.end; i++) {
+                writers_[i].write(frames_[i]);
+            }
+        });
+    }
+    frame_count_++;
+
+    // Publishes a segment as soon as the keyframe after it reaches the file
+    for (size_t i = 0; i < scans_.size(); i++) {
+        if (scan_ts_segments(get_stream_path(renditions_[i].output), scans_[i], segment_frames_, fps_)) {
+            write_media_playlist(renditions_[i].output, scans_[i].segments, get_target_duration(), false);
+        }
+    }
+}
+
+void VideoOutput::release() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        is_done_ = true;
+    }
+    not_empty_.notify_one();
+    if (encoder_.joinable()) {
+        encoder_.join();
+    }
+    for (auto &writer : writers_) {
+        writer.release();
+    }
+    if (segment_frames_ > 0) {
+        finish_segments();
+    }
+}
+
+double VideoOutput::get_compositor_stall() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return compositor_stall_;
+}
+
+double VideoOutput::get_encoder_stall() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return encoder_stall_;
+}
 
 void scale_image_to_width(cv::Mat &img, const int dst_width) {
     double scale = (double)dst_width / (double)img.cols;
@@ -224,9 +527,18 @@ void scale_image_to_fit(cv::Mat &img, Config &conf) {
     cv::resize(img, img, cv::Size(), scale, scale, cv::INTER_LINEAR);
 }
 
+void scale_image_to_cover(cv::Mat &img, Config &conf) {
+    double scale_w = (double)conf.get_width() / (double)img.cols;
+    double scale_h = (double)conf.get_height() / (double)img.rows;
+    double scale = std::max(scale_w, scale_h) * KB_MAX_ZOOM;
+    cv::resize(img, img, cv::Size(), scale, scale, scale < 1.0 ? cv::INTER_AREA : cv::INTER_LINEAR);
+}
+
 void scale_image(cv::Mat &img, Config &conf) {
     if (conf.get_style() == FRAMES) {
         scale_image_to_fit(img, conf);
+    } else if (conf.get_style() == KENBURNS) {
+        scale_image_to_cover(img, conf);
     } else if (conf.get_style() == UP || conf.get_style() == DOWN) {
         scale_image_to_width(img, conf.get_width());
     } else if (conf.get_style() == LEFT || conf.get_style() == RIGHT) {
@@ -235,8 +547,7 @@ void scale_image(cv::Mat &img, Config &conf) {
 }
 
 // Returns dpi to scale page to viewport width
-double get_scaled_dpi_from_width(const poppler::page *page, const int width) {
-    auto rect = page->page_rect(poppler::media_box);
+double get_scaled_dpi_from_width(const poppler::rectf &rect, const int width) {
     if (rect.width() == width) {
         return DEFAULT_DPI;
     }
@@ -244,8 +555,7 @@ double get_scaled_dpi_from_width(const poppler::page *page, const int width) {
 }
 
 // Returns dpi to scale page to viewport width
-double get_scaled_dpi_from_height(const poppler::page *page, const int height) {
-    auto rect = page->page_rect(poppler::media_box);
+double get_scaled_dpi_from_height(const poppler::rectf &rect, const int height) {
     if (rect.height() == height) {
         return DEFAULT_DPI;
     }
@@ -253,10 +563,9 @@ double get_scaled_dpi_from_height(const poppler::page *page, const int height) {
 }
 
 // Returns dpi that will scale the pdf page to fit the viewport dimentions
-double get_scaled_dpi_to_fit(poppler::page *page, Config &conf) {
+double get_scaled_dpi_to_fit(const poppler::rectf &rect, Config &conf) {
     double dpi_w;
     double dpi_h;
-    poppler::rectf rect = page->page_rect(poppler::media_box);
     if (rect.width() > conf.get_width() && rect.height() > conf.get_height()) {
         dpi_w = ((double)conf.get_width() * DEFAULT_DPI) / rect.width();
         dpi_h = ((double)conf.get_height() * DEFAULT_DPI) / rect.height();
@@ -275,6 +584,103 @@ double get_scaled_dpi_to_fit(poppler::page *page, Config &conf) {
     return DEFAULT_DPI;
 }
 
+// Returns dpi that will fill the viewport with the page at KB_MAX_ZOOM
+double get_scaled_dpi_to_cover(const poppler::rectf &rect, Config &conf) {
+    double dpi_w = ((double)conf.get_width() * DEFAULT_DPI) / rect.width();
+    double dpi_h = ((double)conf.get_height() * DEFAULT_DPI) / rect.height();
+    return std::max(dpi_w, dpi_h) * KB_MAX_ZOOM;
+}
+
+// Returns dpi that scales the rect the way scale_image() scales images
+double get_scaled_dpi(const poppler::rectf &rect, Config &conf) {
+    if (conf.get_style() == FRAMES) {
+        return get_scaled_dpi_to_fit(rect, conf);
+    } else if (conf.get_style() == KENBURNS) {
+        return get_scaled_dpi_to_cover(rect, conf);
+    } else if (conf.get_style() == UP || conf.get_style() == DOWN) {
+        return get_scaled_dpi_from_width(rect, conf.get_width());
+    } else if (conf.get_style() == LEFT || conf.get_style() == RIGHT) {
+        return get_scaled_dpi_from_height(rect, conf.get_height());
+    }
+    return DEFAULT_DPI;
+}
+
+// Returns the box around everything that differs from the page background, padded by TRIM_PADDING.
+// Rows and columns are collapsed with cv::reduce, so the scan is two vectorized passes.
+cv::Rect find_content_rect(const cv::Mat &img) {
+    cv::Mat gray;
+    if (img.channels() == 4) {
+        cv::cvtColor(img, gray, cv::COLOR_BGRA2GRAY);
+    } else if (img.channels() == 3) {
+        cv::cvtColor(img, gray, cv::COLOR_BGR2GRAY);
+    } else {
+        gray = img;
+    }
+
+    // Background is the median of the four corners, so one dark corner does not count
+    std::vector<int> corners = {gray.at<uchar>(0, 0), gray.at<uchar>(0, gray.cols - 1),
+                                gray.at<uchar>(gray.rows - 1, 0), gray.at<uchar>(gray.rows - 1, gray.cols - 1)};
+    std::sort(corners.begin(), corners.end());
+    double background = (corners[1] + corners[2]) / 2.0;
+
+    cv::Mat mask;
+    cv::Mat row_max;
+    cv::Mat col_max;
+    cv::absdiff(gray, cv::Scalar(background), mask);
+    cv::threshold(mask, mask, TRIM_THRESHOLD, 255, cv::THRESH_BINARY);
+    cv::reduce(mask, row_max, 1, cv::REDUCE_MAX);
+    cv::reduce(mask, col_max, 0, cv::REDUCE_MAX);
+
+    int top = 0;
+    while (top < gray.rows && row_max.at<uchar>(top, 0) == 0) {
+        top++;
+    }
+    if (top == gray.rows) {
+        return cv::Rect(0, 0, img.cols, img.rows); // blank page
+    }
+    int bottom = gray.rows - 1;
+    while (row_max.at<uchar>(bottom, 0) == 0) {
+        bottom--;
+    }
+    int left = 0;
+    while (col_max.at<uchar>(0, left) == 0) {
+        left++;
+    }
+    int right = gray.cols - 1;
+    while (col_max.at<uchar>(0, right) == 0) {
+        right--;
+    }
+
+    int pad_x = (int)std::ceil(img.cols * TRIM_PADDING);
+    int pad_y = (int)std::ceil(img.rows * TRIM_PADDING);
+    left = std::max(0, left - pad_x);
+    top = std::max(0, top - pad_y);
+    right = std::min(img.cols - 1, right + pad_x);
+    bottom = std::min(img.rows - 1, bottom + pad_y);
+    return cv::Rect(left, top, right - left + 1, bottom - top + 1);
+}
+
+// page_rect() ignores /Rotate but render_page() applies it, so sideways pages swap width and height
+poppler::rectf get_rotated_page_rect(const poppler::page *page, const poppler::page_box_enum box) {
+    poppler::rectf rect = page->page_rect(box);
+    if (page->orientation() == poppler::page::landscape || page->orientation() == poppler::page::seascape) {
+        return poppler::rectf(rect.y(), rect.x(), rect.height(), rect.width());
+    }
+    return rect;
+}
+
+// Maps a content box found on a probe image back to page points, rounding outwards
+poppler::rectf get_content_rect(const cv::Mat &probe, const poppler::rectf &page_rect) {
+    cv::Rect box = find_content_rect(probe);
+    double scale_x = page_rect.width() / probe.cols;
+    double scale_y = page_rect.height() / probe.rows;
+    double x = std::max(0.0, (box.x - 1) * scale_x);
+    double y = std::max(0.0, (box.y - 1) * scale_y);
+    double w = std::min(page_rect.width(), (box.x + box.width + 1) * scale_x) - x;
+    double h = std::min(page_rect.height(), (box.y + box.height + 1) * scale_y) - y;
+    return poppler::rectf(x, y, w, h);
+}
+
 // Returns paths of each file in the directory, excludes nested directories.
 std::vector<std::string> get_dir_img_paths(std::string dir_path) {
     std::map<int, std::string> image_map;
@@ -310,137 +716,816 @@ std::vector<std::string> get_dir_img_paths(std::string dir_path) {
     return image_paths;
 }
 
-// Returns images read from image sequence directory
-void add_dir_images(const std::string dir_path, std::vector<cv::Mat> &vid_images, Config &conf) {
-    std::vector<std::string> img_paths = get_dir_img_paths(dir_path);
+// Returns an image from an image sequence directory, scaled to the viewport
+cv::Mat load_image(const std::string img_path, Config &conf) {
+    cv::Mat mat = cv::imread(img_path);
+    if (mat.empty()) {
+        std::cerr << "<!> '" << img_path << "' could not be read. Skipped." << std::endl;
+        return mat;
+    }
+    if (conf.get_trim()) {
+        mat = mat(find_content_rect(mat)).clone();
+    }
+    scale_image(mat, conf);
+    return mat;
+}
 
-    // Reads images in numerical order
-    size_t count = 0;
-    size_t size = img_paths.size();
-    size_t i = conf.get_is_reverse() ? size - 1 : 0;
-    while (count < size) {
-        // Renders .pdf files
-        if ((int)img_paths[i].find(".pdf") != -1) {
-            add_pdf_images(img_paths[i], vid_images, conf);
-            count++;
-            i += conf.get_is_reverse() ? -1 : 1;
-            continue;
+// !!! Needs more control over fps and such !!!
+// Adds each frame from the .gif file to the image vector, none if it could not be opened.
+void add_gif_images(const std::string gif_path, std::vector<cv::Mat> &vid_images, Config &conf) {
+    cv::VideoCapture cap(gif_path);
+    if (!cap.isOpened()) {
+        std::cerr << "<!> '" << gif_path << "' could not be opened. Skipped." << std::endl;
+        return;
+    }
+    cv::Mat frame;
+    while (cap.read(frame)) {
+        if (frame.empty()) {
+            break;
         }
+        scale_image(frame, conf);
+        vid_images.push_back(frame.clone());
+    }
+}
 
-        // Renders .gif files
-        if ((int)img_paths[i].find(".gif") != -1) {
-            if (conf.get_render_gifs()) {
-                add_gif_images(img_paths[i], vid_images, conf);
-            } else {
-                std::cout << "Note: '" << img_paths[i] << "' skipped. Use --gif to render gif files as support is limited." << std::endl;
+// Returns one pdf page scaled to the viewport, empty if it could not be rendered
+cv::Mat load_pdf_page(const poppler::document *pdf, const std::string pdf_path, const int pg, const std::vector<PageJpeg> &jpegs, Config &conf, bool &is_passthrough) {
+    auto renderer = poppler::page_renderer();
+    std::unique_ptr<poppler::page> page(pdf->create_page(pg));
+    double dpi = DEFAULT_DPI;
+    is_passthrough = false;
+
+    bool has_jpeg = (size_t)pg < jpegs.size() && jpegs[pg].length > 0;
+    poppler::rectf page_rect = get_rotated_page_rect(page.get(), poppler::crop_box);
+    poppler::rectf content(0.0, 0.0, page_rect.width(), page_rect.height());
+
+    // Finds the content box on a cheap low dpi probe
+    if (conf.get_trim()) {
+        cv::Size probe_size((int)std::ceil(page_rect.width() * TRIM_PROBE_DPI / DEFAULT_DPI), (int)std::ceil(page_rect.height() * TRIM_PROBE_DPI / DEFAULT_DPI));
+        cv::Mat probe;
+        if (has_jpeg) {
+            probe = decode_page_jpeg(pdf_path, jpegs[pg], probe_size);
+        } else {
+            poppler::image probe_img = renderer.render_page(page.get(), TRIM_PROBE_DPI, TRIM_PROBE_DPI);
+            probe = poppler_image_to_mat(probe_img);
+        }
+        if (!probe.empty()) {
+            content = get_content_rect(probe, page_rect);
+        }
+    }
+
+    // Scales pages to correctly fit inside video resolution.
+    if (conf.get_trim()) {
+        dpi = get_scaled_dpi(content, conf);
+    } else {
+        dpi = get_scaled_dpi(get_rotated_page_rect(page.get(), poppler::media_box), conf);
+    }
+    cv::Rect content_px((int)std::floor(content.x() * dpi / DEFAULT_DPI), (int)std::floor(content.y() * dpi / DEFAULT_DPI),
+                        (int)std::ceil(content.width() * dpi / DEFAULT_DPI), (int)std::ceil(content.height() * dpi / DEFAULT_DPI));
+
+    // Scanned pages skip the rasterizer and decode their jpeg directly
+    if (has_jpeg) {
+        // Same size poppler would render at this dpi
+        cv::Size dst_size((int)(page_rect.width() * dpi / DEFAULT_DPI + 0.5), (int)(page_rect.height() * dpi / DEFAULT_DPI + 0.5));
+        cv::Mat mat = decode_page_jpeg(pdf_path, jpegs[pg], dst_size);
+        if (!mat.empty()) {
+            if (conf.get_trim()) {
+                content_px.width = std::min(content_px.width, mat.cols - content_px.x);
+                content_px.height = std::min(content_px.height, mat.rows - content_px.y);
+                mat = mat(content_px).clone();
             }
-            count++;
-            i += conf.get_is_reverse() ? -1 : 1;
-            continue;
+            is_passthrough = true;
+            return mat;
         }
+    }
 
-        cv::Mat mat = cv::imread(img_paths[i]);
-        // Updates resolution to first image
-        if (vid_images.size() == 0 && (conf.get_width() == 0 || conf.get_height() == 0)) {
-            if (conf.get_width() == 0) {
-                conf.set_width(mat.cols);
+    // Only the content box gets rasterized when trimming
+    poppler::image img = conf.get_trim()
+        ? renderer.render_page(page.get(), dpi, dpi, content_px.x, content_px.y, content_px.width, content_px.height)
+        : renderer.render_page(page.get(), dpi, dpi);
+    // Determine color space
+    if (img.data() == nullptr) {
+        std::cerr << "<!> Page " << pg << " of '" << pdf_path << "' has no data to load. Skipped." << std::endl;
+        return cv::Mat();
+    } else if (img.format() == poppler::image::format_invalid) {
+        std::cerr << "<!> Page " << pg << " of '" << pdf_path << "' has invalid image format. Skipped." << std::endl;
+        return cv::Mat();
+    }
+    return poppler_image_to_mat(img);
+}
+
+// ===== LOADING SCHEDULER =====
+// Every pdf page, image and gif from every input is one task on a shared pool. Each task
+// writes its own result slot, so the video keeps input order whichever worker finishes first.
+std::vector<cv::Mat> load_plan_images(Plan &plan, Config &conf) {
+    std::vector<PagePlan> &pages = plan.pages;
+    std::vector<std::vector<cv::Mat>> results(pages.size());
+    if (pages.size() == 0) {
+        return {};
+    }
+
+    // Passthrough index is read once per pdf, by whichever worker reaches it first
+    struct PdfSource {
+        std::once_flag once;
+        std::vector<PageJpeg> jpegs;
+    };
+    std::map<std::string, PdfSource> sources;
+    for (const PagePlan &page : pages) {
+        if (page.type == "pdf") {
+            sources[page.path];
+        }
+    }
+
+    // Poppler documents are not shared between threads, each worker opens its own
+    size_t worker_count = std::max((size_t)1, std::min((size_t)std::thread::hardware_concurrency(), pages.size()));
+    std::vector<std::map<std::string, std::unique_ptr<poppler::document>>> documents(worker_count);
+
+    std::mutex progress_mutex;
+    size_t done = 0;
+    std::atomic<int> passthrough_count(0);
+
+    run_work_stealing(pages.size(), worker_count, [&](const size_t worker, const size_t task) {
+        const PagePlan &page = pages[task];
+        if (page.type == "pdf") {
+            std::unique_ptr<poppler::document> &pdf = documents[worker][page.path];
+            if (!pdf) {
+                pdf.reset(poppler::document::load_from_file(page.path));
             }
-            if (conf.get_height() == 0) {
-                conf.set_height(mat.rows);
+            if (!pdf) {
+                std::cerr << "<!> '" << page.path << "' could not be opened. Page " << page.page << " skipped." << std::endl;
+            } else {
+                PdfSource &source = sources.at(page.path);
+                std::call_once(source.once, [&] {
+                    if (conf.get_use_passthrough()) {
+                        source.jpegs = find_page_jpegs(page.path, pdf->pages());
+                    }
+                });
+                bool is_passthrough = false;
+                cv::Mat mat = load_pdf_page(pdf.get(), page.path, page.page, source.jpegs, conf, is_passthrough);
+                if (!mat.empty()) {
+                    results[task].push_back(mat);
+                }
+                passthrough_count += is_passthrough ? 1 : 0;
+            }
+        } else if (page.type == "gif") {
+            add_gif_images(page.path, results[task], conf);
+        } else {
+            cv::Mat mat = load_image(page.path, conf);
+            if (!mat.empty()) {
+                results[task].push_back(mat);
             }
         }
-        scale_image(mat, conf);
-        vid_images.push_back(mat.clone());
-        count++;
-        i += conf.get_is_reverse() ? -1 : 1;
 
         // Status
-        print_progress_bar("Loading Images", count, size, count == 0);
+        std::lock_guard<std::mutex> lock(progress_mutex);
+        done++;
+        print_progress_bar("Loading Images", done, pages.size(), done == 1);
+    });
+
+    if (passthrough_count > 0) {
+        std::cout << COLOR_DIM << "  " << passthrough_count << " pdf pages decoded from embedded jpegs" << COLOR_RESET << std::endl;
+    }
+
+    // Trimmed sizes and skipped pages are only known once loaded, so the timeline is replanned from them
+    std::vector<cv::Mat> images;
+    std::vector<cv::Size> sizes;
+    for (size_t i = 0; i < pages.size(); i++) {
+        pages[i].count = results[i].size();
+        if (!results[i].empty()) {
+            pages[i].width = results[i][0].cols;
+            pages[i].height = results[i][0].rows;
+        }
+        for (cv::Mat &mat : results[i]) {
+            images.push_back(mat);
+            sizes.push_back(mat.size());
+        }
     }
+    if (conf.get_trim() || images.size() != plan.image_count) {
+        plan_timeline(plan, sizes, conf);
+    }
+    return images;
 }
 
-// !!! Needs more control over fps and such !!!
-// Adds each frame from the .gif file to the image vector.
-void add_gif_images(const std::string gif_path, std::vector<cv::Mat> &vid_images, Config &conf) {
-    cv::VideoCapture cap(gif_path);
-    if (!cap.isOpened()) {
-        std::cerr << "<!> Error: Could not open GIF file." << std::endl;
-        exit(1);
+// Each worker starts with a contiguous run of tasks, so neighbouring pdf pages reuse one
+// document. A worker whose deque runs dry steals from the back of the others' deques.
+void run_work_stealing(const size_t task_count, const size_t worker_count, const std::function<void(const size_t worker, const size_t task)> &run_task) {
+    std::vector<std::deque<size_t>> queues(worker_count);
+    std::vector<std::mutex> locks(worker_count);
+    for (size_t task = 0; task < task_count; task++) {
+        queues[task * worker_count / task_count].push_back(task);
     }
-    cv::Mat frame;
-    while (cap.read(frame)) {
-        if (frame.empty()) {
+
+    auto next_task = [&](const size_t worker, size_t &task) {
+        {
+            std::lock_guard<std::mutex> lock(locks[worker]);
+            if (!queues[worker].empty()) {
+                task = queues[worker].front();
+                queues[worker].pop_front();
+                return true;
+            }
+        }
+        for (size_t k = 1; k < worker_count; k++) {
+            size_t victim = (worker + k) % worker_count;
+            std::lock_guard<std::mutex> lock(locks[victim]);
+            if (!queues[victim].empty()) {
+                task = queues[victim].back();
+                queues[victim].pop_back();
+                return true;
+            }
+        }
+        return false;
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t worker = 0; worker < worker_count; worker++) {
+        workers.emplace_back([&, worker] {
+            size_t task;
+            while (next_task(worker, task)) {
+                run_task(worker, task);
+            }
+        });
+    }
+    for (std::thread &thread : workers) {
+        thread.join();
+    }
+}
+
+// Copies a rendered page into a BGR mat, empty if the format is unknown
+cv::Mat poppler_image_to_mat(poppler::image &img) {
+    cv::Mat mat;
+    if (img.format() == poppler::image::format_gray8) {
+        cv::Mat tmp = cv::Mat(img.height(), img.width(), CV_8UC1, img.data(), img.bytes_per_row());
+        cv::cvtColor(tmp, mat, cv::COLOR_GRAY2RGB);
+    } else if (img.format() == poppler::image::format_rgb24) {
+        mat = cv::Mat(img.height(), img.width(), CV_8UC3, img.data(), img.bytes_per_row()).clone();
+    } else if (img.format() == poppler::image::format_bgr24) {
+        cv::Mat tmp = cv::Mat(img.height(), img.width(), CV_8UC3, img.data(), img.bytes_per_row());
+        cv::cvtColor(tmp, mat, cv::COLOR_BGR2RGB);
+    } else if (img.format() == poppler::image::format_argb32) {
+        cv::Mat tmp = cv::Mat(img.height(), img.width(), CV_8UC4, img.data(), img.bytes_per_row());
+        cv::cvtColor(tmp, mat, cv::COLOR_RGBA2RGB);
+    }
+    return mat;
+}
+
+// ===== EMBEDDED IMAGE PASSTHROUGH =====
+// Just enough of a pdf reader to find pages that only draw one full-page jpeg (scans).
+// Anything it does not understand sends the page back to poppler.
+
+struct PdfValue {
+    enum Kind { NONE, NUMBER, NAME, REF, ARRAY, DICT, OTHER };
+    Kind kind = NONE;
+    double number = 0.0;
+    std::string name; // names and keywords
+    int ref = -1;
+    std::vector<PdfValue> items; // array values, or dict keys and values interleaved
+};
+
+struct PdfObject {
+    PdfValue value;
+    bool has_stream = false;
+    size_t stream_offset = 0;
+    size_t stream_length = 0;
+};
+
+typedef std::map<int, PdfObject> PdfObjects;
+
+static bool pdf_is_space(const char c) {
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\f' || c == '\0';
+}
+
+static bool pdf_is_delim(const char c) {
+    return pdf_is_space(c) || c == '(' || c == ')' || c == '<' || c == '>' || c == '[' || c == ']'
+        || c == '{' || c == '}' || c == '/' || c == '%';
+}
+
+static void pdf_skip_space(const std::string_view buf, size_t &pos) {
+    while (pos < buf.size()) {
+        if (buf[pos] == '%') {
+            while (pos < buf.size() && buf[pos] != '\n' && buf[pos] != '\r') {
+                pos++;
+            }
+        } else if (pdf_is_space(buf[pos])) {
+            pos++;
+        } else {
             break;
         }
-        scale_image(frame, conf);
-        vid_images.push_back(frame.clone());
     }
 }
 
-// Returns images read from pdf files
-void add_pdf_images(const std::string pdf_path, std::vector<cv::Mat> &vid_images, Config &conf) {
-    auto renderer = poppler::page_renderer();
-    poppler::document *pdf = poppler::document::load_from_file(pdf_path);
+static std::string pdf_read_token(const std::string_view buf, size_t &pos) {
+    size_t start = pos;
+    while (pos < buf.size() && !pdf_is_delim(buf[pos])) {
+        pos++;
+    }
+    return std::string(buf.substr(start, pos - start));
+}
 
-    // Gets pages of individual pdf files
-    for (int pg = 0; pg < pdf->pages(); pg++) {
-        double dpi = DEFAULT_DPI;
-        poppler::page *page = pdf->create_page(pg);
+static PdfValue pdf_parse_value(const std::string_view buf, size_t &pos, const int depth = 0) {
+    PdfValue val;
+    pdf_skip_space(buf, pos);
+    if (pos >= buf.size() || depth > 32) {
+        return val;
+    }
 
-        // Updates resolution to first image
-        if (vid_images.size() == 0 && (conf.get_width() == 0 || conf.get_height() == 0)) {
-            if (conf.get_width() == 0) {
-                conf.set_width(page->page_rect().width());
+    char c = buf[pos];
+    if (c == '<' && pos + 1 < buf.size() && buf[pos + 1] == '<') {
+        pos += 2;
+        val.kind = PdfValue::DICT;
+        while (true) {
+            pdf_skip_space(buf, pos);
+            if (pos >= buf.size()) {
+                break;
             }
-            if (conf.get_height() == 0) {
-                conf.set_height(page->page_rect().height());
+            if (buf.compare(pos, 2, ">>") == 0) {
+                pos += 2;
+                break;
+            }
+            PdfValue key = pdf_parse_value(buf, pos, depth + 1);
+            if (key.kind != PdfValue::NAME) {
+                break;
+            }
+            val.items.push_back(key);
+            val.items.push_back(pdf_parse_value(buf, pos, depth + 1));
+        }
+    } else if (c == '[') {
+        pos++;
+        val.kind = PdfValue::ARRAY;
+        while (true) {
+            pdf_skip_space(buf, pos);
+            if (pos >= buf.size()) {
+                break;
+            }
+            if (buf[pos] == ']') {
+                pos++;
+                break;
+            }
+            val.items.push_back(pdf_parse_value(buf, pos, depth + 1));
+        }
+    } else if (c == '(') {
+        // Literal string, contents are never needed
+        int parens = 0;
+        val.kind = PdfValue::OTHER;
+        while (pos < buf.size()) {
+            if (buf[pos] == '\\') {
+                pos++;
+            } else if (buf[pos] == '(') {
+                parens++;
+            } else if (buf[pos] == ')' && --parens == 0) {
+                pos++;
+                break;
             }
+            pos++;
         }
+    } else if (c == '<') {
+        // Hex string
+        size_t end = buf.find('>', pos);
+        pos = end == std::string_view::npos ? buf.size() : end + 1;
+        val.kind = PdfValue::OTHER;
+    } else if (c == '/') {
+        pos++;
+        val.kind = PdfValue::NAME;
+        val.name = pdf_read_token(buf, pos);
+    } else if (c == '+' || c == '-' || c == '.' || (c >= '0' && c <= '9')) {
+        std::string token = pdf_read_token(buf, pos);
+        val.kind = PdfValue::NUMBER;
+        val.number = std::atof(token.c_str());
 
-        // Scales pages to correctly fit inside video resolution.
-        if (conf.get_style()== FRAMES) {
-            dpi = get_scaled_dpi_to_fit(page, conf);
-        } else if (conf.get_style() == UP || conf.get_style() == DOWN) {
-            dpi = get_scaled_dpi_from_width(page, conf.get_width());
-        } else if (conf.get_style() == LEFT || conf.get_style() == RIGHT) {
-            dpi = get_scaled_dpi_from_height(page, conf.get_height());
+        // "<num> <gen> R" is a reference
+        size_t after = pos;
+        pdf_skip_space(buf, after);
+        if (token.find_first_not_of("0123456789") == std::string::npos && after < buf.size() && isdigit(buf[after])) {
+            std::string gen = pdf_read_token(buf, after);
+            pdf_skip_space(buf, after);
+            if (gen.find_first_not_of("0123456789") == std::string::npos && after < buf.size() && buf[after] == 'R'
+                && (after + 1 == buf.size() || pdf_is_delim(buf[after + 1]))) {
+                val.kind = PdfValue::REF;
+                val.ref = std::atoi(token.c_str());
+                pos = after + 1;
+            }
+        }
+    } else {
+        val.kind = PdfValue::OTHER;
+        val.name = pdf_read_token(buf, pos);
+        if (val.name.empty()) {
+            pos++; // stray delimiter
         }
+    }
+    return val;
+}
 
-        poppler::image img = renderer.render_page(page, dpi, dpi);
-        cv::Mat mat;
-        // Determine color space
-        if (img.data() == nullptr) {
-            std::cerr << "<!> Page " << pg << " has no data to load. Skipped." << std::endl;
-            vid_images.erase(vid_images.begin() + pg);
+// Returns the value stored under key, or nullptr
+static const PdfValue *pdf_get(const PdfValue &dict, const std::string &key) {
+    if (dict.kind != PdfValue::DICT) {
+        return nullptr;
+    }
+    for (size_t i = 0; i + 1 < dict.items.size(); i += 2) {
+        if (dict.items[i].name == key) {
+            return &dict.items[i + 1];
+        }
+    }
+    return nullptr;
+}
+
+// Follows references, returns nullptr when the object is missing
+static const PdfValue *pdf_resolve(const PdfObjects &objs, const PdfValue *val) {
+    for (int hops = 0; val != nullptr && val->kind == PdfValue::REF && hops < 8; hops++) {
+        auto it = objs.find(val->ref);
+        val = it == objs.end() ? nullptr : &it->second.value;
+    }
+    return val != nullptr && val->kind == PdfValue::REF ? nullptr : val;
+}
+
+static const PdfObject *pdf_find_object(const PdfObjects &objs, const PdfValue *val) {
+    if (val == nullptr || val->kind != PdfValue::REF) {
+        return nullptr;
+    }
+    auto it = objs.find(val->ref);
+    return it == objs.end() ? nullptr : &it->second;
+}
+
+static bool pdf_name_is(const PdfValue *val, const std::string &name) {
+    return val != nullptr && val->kind == PdfValue::NAME && val->name == name;
+}
+
+// Indexes every "<num> <gen> obj" in file order, so later revisions replace earlier ones.
+// Objects packed in compressed object streams are not found.
+static PdfObjects pdf_scan_objects(const std::string_view buf) {
+    PdfObjects objs;
+    size_t pos = 0;
+    while ((pos = buf.find("obj", pos)) != std::string_view::npos) {
+        size_t at = pos;
+        pos += 3;
+        if (pos < buf.size() && !pdf_is_delim(buf[pos])) {
             continue;
-        } else if (img.format() == poppler::image::format_invalid) {
-            std::cerr << "<!> Page " << pg << " has invalid image format. Skipped." << std::endl;
-            vid_images.erase(vid_images.begin() + pg);
+        }
+
+        // Walks back over "<num> <gen> "
+        size_t p = at;
+        bool valid = true;
+        for (int n = 0; n < 2 && valid; n++) {
+            valid = p > 0 && pdf_is_space(buf[p - 1]);
+            while (p > 0 && pdf_is_space(buf[p - 1])) {
+                p--;
+            }
+            size_t end = p;
+            while (p > 0 && isdigit(buf[p - 1])) {
+                p--;
+            }
+            valid = valid && p < end;
+        }
+        if (!valid || (p > 0 && !pdf_is_delim(buf[p - 1]))) {
             continue;
-        } else if (img.format() == poppler::image::format_gray8) {
-            cv::Mat tmp = cv::Mat(img.height(), img.width(), CV_8UC1, img.data(), img.bytes_per_row());
-            cv::cvtColor(tmp, mat, cv::COLOR_GRAY2RGB);
-        } else if (img.format() == poppler::image::format_rgb24) {
-            mat = cv::Mat(img.height(), img.width(), CV_8UC3, img.data(), img.bytes_per_row());
-        } else if (img.format() == poppler::image::format_bgr24) {
-            cv::Mat tmp = cv::Mat(img.height(), img.width(), CV_8UC3, img.data(), img.bytes_per_row());
-            cv::cvtColor(tmp, mat, cv::COLOR_BGR2RGB);
-        } else if (img.format() == poppler::image::format_argb32) {
-            cv::Mat tmp = cv::Mat(img.height(), img.width(), CV_8UC4, img.data(), img.bytes_per_row());
-            cv::cvtColor(tmp, mat, cv::COLOR_RGBA2RGB);
-        }
-        vid_images.push_back(mat.clone());
+        }
+        int num = std::atoi(std::string(buf.substr(p, at - p)).c_str());
 
-        // Status
-        print_progress_bar("Loading Images", pg, pdf->pages(), pg == 0);
+        PdfObject obj;
+        obj.value = pdf_parse_value(buf, pos);
+        size_t after = pos;
+        pdf_skip_space(buf, after);
+        if (buf.compare(after, 6, "stream") == 0) {
+            size_t data = after + 6;
+            if (data < buf.size() && buf[data] == '\r') {
+                data++;
+            }
+            if (data < buf.size() && buf[data] == '\n') {
+                data++;
+            }
+            const PdfValue *length = pdf_get(obj.value, "Length");
+            size_t end = std::string_view::npos;
+            if (length != nullptr && length->kind == PdfValue::NUMBER && data + (size_t)length->number <= buf.size()) {
+                end = buf.find("endstream", data + (size_t)length->number);
+                obj.stream_length = (size_t)length->number;
+            } else {
+                // Indirect /Length gets resolved after the scan
+                end = buf.find("endstream", data);
+                obj.stream_length = end == std::string_view::npos ? 0 : end - data;
+            }
+            if (end == std::string_view::npos) {
+                break;
+            }
+            obj.has_stream = true;
+            obj.stream_offset = data;
+            pos = end + 9;
+        }
+        objs[num] = obj;
+    }
+
+    for (auto &entry : objs) {
+        PdfObject &obj = entry.second;
+        const PdfValue *length = pdf_get(obj.value, "Length");
+        if (obj.has_stream && length != nullptr && length->kind == PdfValue::REF) {
+            const PdfValue *resolved = pdf_resolve(objs, length);
+            if (resolved != nullptr && resolved->kind == PdfValue::NUMBER && (size_t)resolved->number <= obj.stream_length) {
+                obj.stream_length = (size_t)resolved->number;
+            }
+        }
+    }
+    return objs;
+}
+
+static bool pdf_inflate(const std::string_view src, std::string &dst) {
+    z_stream zs = {};
+    if (inflateInit(&zs) != Z_OK) {
+        return false;
+    }
+    zs.next_in = (Bytef *)src.data();
+    zs.avail_in = (uInt)src.size();
+    char out[16384];
+    int ret = Z_OK;
+    while (ret != Z_STREAM_END && dst.size() < (1 << 20)) {
+        zs.next_out = (Bytef *)out;
+        zs.avail_out = sizeof(out);
+        ret = inflate(&zs, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+            break;
+        }
+        dst.append(out, sizeof(out) - zs.avail_out);
+    }
+    inflateEnd(&zs);
+    return ret == Z_STREAM_END;
+}
+
+// Appends the decoded content stream, only unfiltered and FlateDecode streams are read
+static bool pdf_append_contents(const std::string_view buf, const PdfObject *obj, std::string &contents) {
+    if (obj == nullptr || !obj->has_stream) {
+        return false;
+    }
+    std::string_view data = buf.substr(obj->stream_offset, obj->stream_length);
+    const PdfValue *filter = pdf_get(obj->value, "Filter");
+    if (filter != nullptr && filter->kind == PdfValue::ARRAY && filter->items.size() == 1) {
+        filter = &filter->items[0];
+    }
+    if (filter == nullptr) {
+        contents += data;
+    } else if (pdf_name_is(filter, "FlateDecode") && pdf_get(obj->value, "DecodeParms") == nullptr) {
+        if (!pdf_inflate(data, contents)) {
+            return false;
+        }
+    } else {
+        return false;
+    }
+    contents += "\n";
+    return true;
+}
+
+// Returns the jpeg a page draws, or a zero-length PageJpeg if the page draws anything else
+static PageJpeg pdf_check_page(const std::string_view buf, const PdfObjects &objs, const PdfValue &page,
+                               const PdfValue *resources, const PdfValue *box, const int rotate) {
+    PageJpeg none = {0, 0, 0, 0};
+    if (rotate % 360 != 0 || resources == nullptr || box == nullptr || box->kind != PdfValue::ARRAY || box->items.size() != 4) {
+        return none;
+    }
+    for (const PdfValue &coord : box->items) {
+        if (coord.kind != PdfValue::NUMBER) {
+            return none;
+        }
+    }
+    double x0 = std::min(box->items[0].number, box->items[2].number);
+    double y0 = std::min(box->items[1].number, box->items[3].number);
+    double page_w = std::abs(box->items[2].number - box->items[0].number);
+    double page_h = std::abs(box->items[3].number - box->items[1].number);
+
+    // Only one image xobject and nothing that could draw text or shading
+    const PdfValue *fonts = pdf_resolve(objs, pdf_get(*resources, "Font"));
+    if ((fonts != nullptr && !fonts->items.empty()) || pdf_get(*resources, "Shading") != nullptr || pdf_get(*resources, "Pattern") != nullptr) {
+        return none;
+    }
+    const PdfValue *xobjects = pdf_resolve(objs, pdf_get(*resources, "XObject"));
+    if (xobjects == nullptr || xobjects->kind != PdfValue::DICT || xobjects->items.size() != 2) {
+        return none;
+    }
+    const std::string image_name = xobjects->items[0].name;
+    const PdfObject *image = pdf_find_object(objs, &xobjects->items[1]);
+    if (image == nullptr || !image->has_stream) {
+        return none;
+    }
+
+    // Baseline 8-bit rgb or gray jpeg with nothing that changes its pixels
+    const PdfValue &dict = image->value;
+    const PdfValue *filter = pdf_get(dict, "Filter");
+    if (filter != nullptr && filter->kind == PdfValue::ARRAY && filter->items.size() == 1) {
+        filter = &filter->items[0];
+    }
+    const PdfValue *color_space = pdf_resolve(objs, pdf_get(dict, "ColorSpace"));
+    const PdfValue *bpc = pdf_resolve(objs, pdf_get(dict, "BitsPerComponent"));
+    const PdfValue *width = pdf_resolve(objs, pdf_get(dict, "Width"));
+    const PdfValue *height = pdf_resolve(objs, pdf_get(dict, "Height"));
+    if (!pdf_name_is(pdf_get(dict, "Subtype"), "Image") || !pdf_name_is(filter, "DCTDecode")
+        || !(pdf_name_is(color_space, "DeviceRGB") || pdf_name_is(color_space, "DeviceGray"))
+        || bpc == nullptr || bpc->number != 8 || width == nullptr || height == nullptr
+        || pdf_get(dict, "Decode") != nullptr || pdf_get(dict, "SMask") != nullptr
+        || pdf_get(dict, "Mask") != nullptr || pdf_get(dict, "ImageMask") != nullptr) {
+        return none;
+    }
+
+    // Content may only be q/Q/cm and a single Do of that image
+    std::string contents;
+    const PdfValue *contents_val = pdf_get(page, "Contents");
+    if (contents_val != nullptr && contents_val->kind == PdfValue::REF) {
+        const PdfValue *resolved = pdf_resolve(objs, contents_val);
+        if (resolved != nullptr && resolved->kind == PdfValue::ARRAY) {
+            contents_val = resolved;
+        }
+    }
+    if (contents_val == nullptr) {
+        return none;
+    } else if (contents_val->kind == PdfValue::ARRAY) {
+        for (const PdfValue &part : contents_val->items) {
+            if (!pdf_append_contents(buf, pdf_find_object(objs, &part), contents)) {
+                return none;
+            }
+        }
+    } else if (!pdf_append_contents(buf, pdf_find_object(objs, contents_val), contents)) {
+        return none;
+    }
+
+    std::vector<std::array<double, 6>> ctm_stack = {{1, 0, 0, 1, 0, 0}};
+    std::vector<PdfValue> operands;
+    int draws = 0;
+    size_t pos = 0;
+    while (true) {
+        pdf_skip_space(contents, pos);
+        if (pos >= contents.size()) {
+            break;
+        }
+        PdfValue tok = pdf_parse_value(contents, pos);
+        if (tok.kind != PdfValue::OTHER || tok.name.empty()) {
+            operands.push_back(tok);
+            continue;
+        }
+        if (tok.name == "q") {
+            ctm_stack.push_back(ctm_stack.back());
+        } else if (tok.name == "Q") {
+            if (ctm_stack.size() < 2) {
+                return none;
+            }
+            ctm_stack.pop_back();
+        } else if (tok.name == "cm") {
+            if (operands.size() != 6) {
+                return none;
+            }
+            double m[6];
+            for (int k = 0; k < 6; k++) {
+                if (operands[k].kind != PdfValue::NUMBER) {
+                    return none;
+                }
+                m[k] = operands[k].number;
+            }
+            std::array<double, 6> &c = ctm_stack.back();
+            c = {m[0] * c[0] + m[1] * c[2], m[0] * c[1] + m[1] * c[3],
+                 m[2] * c[0] + m[3] * c[2], m[2] * c[1] + m[3] * c[3],
+                 m[4] * c[0] + m[5] * c[2] + c[4], m[4] * c[1] + m[5] * c[3] + c[5]};
+        } else if (tok.name == "Do") {
+            if (operands.size() != 1 || !pdf_name_is(&operands[0], image_name)) {
+                return none;
+            }
+            // Image unit square must land on the page box
+            const std::array<double, 6> &c = ctm_stack.back();
+            double tol_w = std::max(1.0, page_w * 0.01);
+            double tol_h = std::max(1.0, page_h * 0.01);
+            if (std::abs(c[1]) > 1e-3 || std::abs(c[2]) > 1e-3 || std::abs(c[0] - page_w) > tol_w || std::abs(c[3] - page_h) > tol_h
+                || std::abs(c[4] - x0) > tol_w || std::abs(c[5] - y0) > tol_h) {
+                return none;
+            }
+            draws++;
+        } else {
+            return none;
+        }
+        operands.clear();
+    }
+    if (draws != 1) {
+        return none;
+    }
+
+    return {image->stream_offset, image->stream_length, (int)width->number, (int)height->number};
+}
+
+// Walks the page tree in order, carrying inherited attributes down to each page
+static void pdf_collect_pages(const std::string_view buf, const PdfObjects &objs, const PdfValue *node, const PdfValue *resources,
+                              const PdfValue *box, int rotate, std::vector<PageJpeg> &jpegs, const int depth) {
+    node = pdf_resolve(objs, node);
+    if (node == nullptr || node->kind != PdfValue::DICT || depth > 64) {
+        return;
+    }
+    if (pdf_get(*node, "Resources") != nullptr) {
+        resources = pdf_resolve(objs, pdf_get(*node, "Resources"));
+    }
+    if (pdf_get(*node, "MediaBox") != nullptr) {
+        box = pdf_resolve(objs, pdf_get(*node, "MediaBox"));
+    }
+    if (pdf_get(*node, "CropBox") != nullptr) {
+        box = pdf_resolve(objs, pdf_get(*node, "CropBox"));
+    }
+    const PdfValue *rot = pdf_resolve(objs, pdf_get(*node, "Rotate"));
+    if (rot != nullptr && rot->kind == PdfValue::NUMBER) {
+        rotate = (int)rot->number;
+    }
+
+    const PdfValue *kids = pdf_resolve(objs, pdf_get(*node, "Kids"));
+    if (pdf_name_is(pdf_get(*node, "Type"), "Pages") || kids != nullptr) {
+        if (kids == nullptr || kids->kind != PdfValue::ARRAY) {
+            return;
+        }
+        for (const PdfValue &kid : kids->items) {
+            pdf_collect_pages(buf, objs, &kid, resources, box, rotate, jpegs, depth + 1);
+        }
+    } else {
+        jpegs.push_back(pdf_check_page(buf, objs, *node, resources, box, rotate));
     }
 }
 
+// Read-only view of a whole pdf. Scans can be hundreds of MB and several are indexed at once,
+// so the file is mapped rather than copied; the image streams the scan skips are never paged in.
+struct PdfMapping {
+    const char *data = nullptr;
+    size_t size = 0;
+
+    PdfMapping(const std::string &path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *addr = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr != MAP_FAILED) {
+                data = static_cast<const char *>(addr);
+                size = (size_t)st.st_size;
+            }
+        }
+        close(fd);
+    }
+    ~PdfMapping() {
+        if (data != nullptr) {
+            munmap(const_cast<char *>(data), size);
+        }
+    }
+    PdfMapping(const PdfMapping &) = delete;
+    PdfMapping &operator=(const PdfMapping &) = delete;
+};
+
+// Returns one entry per page; pages that are not a single full-page jpeg have length 0.
+// Returns an empty vector when the page tree could not be read.
+std::vector<PageJpeg> find_page_jpegs(const std::string pdf_path, const int page_count) {
+    PdfMapping mapping(pdf_path);
+    if (mapping.data == nullptr) {
+        return {};
+    }
+    const std::string_view buf(mapping.data, mapping.size);
+    PdfObjects objs = pdf_scan_objects(buf);
+
+    const PdfValue *pages = nullptr;
+    for (const auto &entry : objs) {
+        if (pdf_name_is(pdf_get(entry.second.value, "Type"), "Catalog")) {
+            pages = pdf_get(entry.second.value, "Pages");
+        }
+    }
+    std::vector<PageJpeg> jpegs;
+    if (pages != nullptr) {
+        pdf_collect_pages(buf, objs, pages, nullptr, nullptr, 0, jpegs, 0);
+    }
+    if ((int)jpegs.size() != page_count) {
+        return {};
+    }
+    return jpegs;
+}
+
+// Decodes the embedded jpeg straight to dst_size, using libjpeg's scaled decode when the scan is much larger.
+cv::Mat decode_page_jpeg(const std::string pdf_path, const PageJpeg &jpeg, const cv::Size dst_size) {
+    std::ifstream file(pdf_path, std::ios::binary);
+    std::vector<uchar> data(jpeg.length);
+    file.seekg(jpeg.offset);
+    if (!file.read(reinterpret_cast<char *>(data.data()), data.size())) {
+        return cv::Mat();
+    }
+
+    int flags = cv::IMREAD_COLOR;
+    if (jpeg.width / 8 >= dst_size.width && jpeg.height / 8 >= dst_size.height) {
+        flags = cv::IMREAD_REDUCED_COLOR_8;
+    } else if (jpeg.width / 4 >= dst_size.width && jpeg.height / 4 >= dst_size.height) {
+        flags = cv::IMREAD_REDUCED_COLOR_4;
+    } else if (jpeg.width / 2 >= dst_size.width && jpeg.height / 2 >= dst_size.height) {
+        flags = cv::IMREAD_REDUCED_COLOR_2;
+    }
+    // Pdf viewers ignore exif rotation, so poppler would too
+    cv::Mat mat = cv::imdecode(data, flags | cv::IMREAD_IGNORE_ORIENTATION);
+    if (mat.empty()) {
+        return mat;
+    }
+    if (mat.size() != dst_size) {
+        int interpolation = mat.cols > dst_size.width ? cv::INTER_AREA : cv::INTER_LINEAR;
+        cv::resize(mat, mat, dst_size, 0, 0, interpolation);
+    }
+    return mat;
+}
+
 // Classic image sequence effect
-void render_video_sequence(cv::VideoWriter &vid, const std::vector<cv::Mat> &imgs, Config &conf) {
+void render_video_sequence(VideoOutput &vid, const std::vector<cv::Mat> &imgs, Config &conf) {
     for (size_t i = 0; i < imgs.size(); i++) {
         cv::Mat img = imgs[i];
-        cv::Mat vp_img = cv::Mat(conf.get_height(), conf.get_width(), img.type(), cv::Scalar(0, 0, 0));
+        cv::Mat &vp_img = vid.acquire_frame();
+        vp_img.setTo(cv::Scalar(0, 0, 0));
         int x = 0;
         int y = 0;
 
@@ -455,7 +1540,7 @@ void render_video_sequence(cv::VideoWriter &vid, const std::vector<cv::Mat> &img
         // Keeps them within the vp.
         cv::Rect2i roi(x, y, img.cols, img.rows);
         img.copyTo(vp_img(roi));
-        vid.write(vp_img);
+        vid.submit_frame();
 
         // Status
         print_progress_bar("Rendering Video", i + 1, imgs.size(), i == 0);
@@ -465,11 +1550,10 @@ void render_video_sequence(cv::VideoWriter &vid, const std::vector<cv::Mat> &img
 
 
 // ===== SCROLL EFFECTS =====
-void render_video_scroll_up(cv::VideoWriter &vid, const std::vector<cv::Mat> &imgs, Config &conf) {
-    double px_per_frame = get_pixels_per_frame(imgs, conf);
+void render_video_scroll_up(VideoOutput &vid, const std::vector<cv::Mat> &imgs, const Plan &plan, Config &conf) {
+    const double px_per_frame = plan.px_per_frame;
     double y_pos = 0.0f;
     cv::Mat dst_img(conf.get_height() + imgs[0].rows, conf.get_width(), CV_8UC3, cv::Scalar(0, 0, 0)); // Black Box ( video height + first img height by video width )
-    cv::Mat vp_img(conf.get_height(), conf.get_width(), CV_8UC3, cv::Scalar(0, 0, 0));
 
     // Generates and writes frames to video file. Prevents creating space between each new img.
     for (size_t i = 0; i < imgs.size(); i++) {
@@ -497,12 +1581,12 @@ void render_video_scroll_up(cv::VideoWriter &vid, const std::vector<cv::Mat> &im
             y_pos = 0.0f;
         }
 
-        // Write frames to video.
-        while (((double)dst_img.rows - (y_pos+ conf.get_height())) > px_per_frame) {
+        // Write frames to video. Planned sizes can round a pixel apart from the loaded ones, so the view never passes the buffer.
+        for (size_t f = 0; f < plan.image_frames[i]; f++) {
             cv::Rect2d roi(0.0f, y_pos, conf.get_width(), conf.get_height());
-            dst_img(roi).copyTo(vp_img);
-            vid.write(vp_img);
-            y_pos += px_per_frame;
+            dst_img(roi).copyTo(vid.acquire_frame());
+            vid.submit_frame();
+            y_pos = std::min(y_pos + px_per_frame, (double)(dst_img.rows - conf.get_height()));
         }
 
         // Status
@@ -511,11 +1595,10 @@ void render_video_scroll_up(cv::VideoWriter &vid, const std::vector<cv::Mat> &im
 }
 
 //
-void render_video_scroll_left(cv::VideoWriter &vid, const std::vector<cv::Mat> &imgs, Config &conf) {
-    double px_per_frame = get_pixels_per_frame(imgs, conf);
+void render_video_scroll_left(VideoOutput &vid, const std::vector<cv::Mat> &imgs, const Plan &plan, Config &conf) {
+    const double px_per_frame = plan.px_per_frame;
     double x_pos = 0.0f;
     cv::Mat dst_img(conf.get_height(), (conf.get_width() + imgs[0].cols), CV_8UC3, cv::Scalar(0, 0, 0)); // Contains frame content ( video height by video width + first img width)
-    cv::Mat vp_img(conf.get_height(), conf.get_width(), CV_8UC3, cv::Scalar(0, 0, 0)); // Frame content gets rendered here
 
     for (size_t i = 0; i < imgs.size(); i++) {
         if (i == 0) {
@@ -545,12 +1628,12 @@ void render_video_scroll_left(cv::VideoWriter &vid, const std::vector<cv::Mat> &
             x_pos = 0.0f;
         }
 
-        // Write frames to video
-        while (((double)dst_img.cols - (conf.get_width() + x_pos)) > px_per_frame) {
+        // Write frames to video, stopping at the buffer's edge like scroll up
+        for (size_t f = 0; f < plan.image_frames[i]; f++) {
             cv::Rect2d roi(x_pos, 0.0f, conf.get_width(), conf.get_height());
-            dst_img(roi).copyTo(vp_img);
-            vid.write(vp_img);
-            x_pos += px_per_frame;
+            dst_img(roi).copyTo(vid.acquire_frame()); // Frame content gets rendered here
+            vid.submit_frame();
+            x_pos = std::min(x_pos + px_per_frame, (double)(dst_img.cols - conf.get_width()));
         }
 
         // Status
@@ -558,28 +1641,522 @@ void render_video_scroll_left(cv::VideoWriter &vid, const std::vector<cv::Mat> &
     }
 }
 
+// ===== KEN BURNS =====
+// Pans and zooms over each page. Pages are loaded at cover scale times KB_MAX_ZOOM, so even the
+// widest view samples at most KB_MAX_ZOOM source pixels per output pixel and no mip levels are needed.
+// Frames sample through separable fixed-point tables, so per-frame cost is two SIMD blends per output pixel.
+void render_video_ken_burns(VideoOutput &vid, const std::vector<cv::Mat> &imgs, const Plan &plan, Config &conf) {
+    const cv::Size vp_size(conf.get_width(), conf.get_height());
+
+    // Pages of the same size and direction follow the same path, so their tables are reused.
+    // Only the current page size is kept; a new size starts a fresh cache.
+    std::map<std::array<int, 2>, KenBurnsTable> table_cache;
+    cv::Size cache_size;
+
+    for (size_t i = 0; i < imgs.size(); i++) {
+        const cv::Mat &img = imgs[i];
+        const int page_frames = plan.image_frames[i];
+        if (img.cols < 2 || img.rows < 2) {
+            continue;
+        }
+
+        if (img.size() != cache_size) {
+            table_cache.clear();
+            cache_size = img.size();
+        }
+
+        // Even pages zoom in, odd pages zoom out. Tall pages pan down, wide pages pan right.
+        const double zoom_start = i % 2 == 0 ? 1.0 : KB_MAX_ZOOM;
+        const double zoom_end = i % 2 == 0 ? KB_MAX_ZOOM : 1.0;
+        const bool is_tall = (double)img.rows / img.cols > (double)vp_size.height / vp_size.width;
+        const double cover = std::min((double)img.cols / vp_size.width, (double)img.rows / vp_size.height);
+
+        for (int f = 0; f < page_frames; f++) {
+            std::array<int, 2> key = {(int)(i % 2), f};
+            auto cached = table_cache.find(key);
+            if (cached == table_cache.end()) {
+                double t = page_frames > 1 ? (double)f / (page_frames - 1) : 0.5;
+                t = t * t * (3.0 - 2.0 * t); // ease in and out
+                double zoom = zoom_start + (zoom_end - zoom_start) * t;
+                double crop_w = vp_size.width * cover / zoom;
+                double crop_h = vp_size.height * cover / zoom;
+                double pan_x = is_tall ? 0.5 : t;
+                double pan_y = is_tall ? t : 0.5;
+                cv::Rect2d crop((img.cols - crop_w) * pan_x, (img.rows - crop_h) * pan_y, crop_w, crop_h);
+                cached = table_cache.emplace(key, make_ken_burns_table(img, crop, vp_size)).first;
+            }
+
+            const KenBurnsTable &table = cached->second;
+            remap_bilinear(img, vid.acquire_frame(), table);
+            vid.submit_frame();
+        }
+
+        // Status
+        print_progress_bar("Rendering Video", i + 1, imgs.size(), i == 0);
+    }
+}
+
+// Spreads -d evenly over the pages, otherwise each page lasts -s seconds
+int get_ken_burns_frames(const size_t image_count, Config &conf) {
+    double seconds = conf.get_spp();
+    if (conf.get_duration() != 0 && image_count > 0) {
+        seconds = conf.get_duration() / image_count;
+    }
+    return std::max(1, (int)std::round(seconds * conf.get_fps()));
+}
+
+// Maps each viewport pixel centre into the crop of src
+KenBurnsTable make_ken_burns_table(const cv::Mat &src, const cv::Rect2d crop, const cv::Size vp_size) {
+    KenBurnsTable table;
+
+    auto fill = [](std::vector<int> &idx, std::vector<uchar> &weight, const int count, const int src_len,
+                   const double start, const double step) {
+        idx.resize(count);
+        weight.resize(count);
+        for (int k = 0; k < count; k++) {
+            double pos = start + (k + 0.5) * step - 0.5;
+            pos = std::min(std::max(pos, 0.0), (double)(src_len - 1));
+            int i0 = std::min((int)pos, src_len - 2);
+            idx[k] = i0;
+            weight[k] = (uchar)std::min(255, (int)((pos - i0) * 256.0));
+        }
+    };
+    std::vector<int> x_px;
+    std::vector<uchar> x_px_w;
+    fill(x_px, x_px_w, vp_size.width, src.cols, crop.x, crop.width / vp_size.width);
+    fill(table.y_row, table.y_w, vp_size.height, src.rows, crop.y, crop.height / vp_size.height);
+
+    // Weights are repeated for each byte of the 4-byte pixel loads in remap_bilinear()
+    table.x_start = x_px.front() * 3;
+    table.x_ofs.resize(vp_size.width);
+    table.x_w.resize(vp_size.width * 4);
+    for (int u = 0; u < vp_size.width; u++) {
+        table.x_ofs[u] = x_px[u] * 3 - table.x_start;
+        std::fill(table.x_w.begin() + u * 4, table.x_w.begin() + u * 4 + 4, x_px_w[u]);
+    }
+    return table;
+}
+
+// Bilinear CV_8UC3 sampling. Rows are blended vertically into a scratch line, then the left and
+// right pixel of each output column are gathered from it and blended. Both passes use SIMD.
+void remap_bilinear(const cv::Mat &src, cv::Mat &dst, const KenBurnsTable &table) {
+    const int len = table.x_ofs.back() + 6;
+
+    cv::parallel_for_(cv::Range(0, dst.rows), [&](const cv::Range &range) {
+        std::vector<uchar> line(len + 1); // pixels are loaded as 4 bytes, the last one may read the pad
+        for (int v = range.start; v < range.end; v++) {
+            const uchar *row0 = src.ptr<uchar>(table.y_row[v]) + table.x_start;
+            const uchar *row1 = src.ptr<uchar>(table.y_row[v] + 1) + table.x_start;
+            const int wy = table.y_w[v];
+            int j = 0;
+#if CV_SIMD128
+            // Products stay below 2^16, so the cheap wrapping multiply is exact
+            const cv::v_uint16x8 full = cv::v_setall_u16(256);
+            const cv::v_uint16x8 half = cv::v_setall_u16(128);
+            const cv::v_uint16x8 w0 = cv::v_setall_u16((ushort)(256 - wy));
+            const cv::v_uint16x8 w1 = cv::v_setall_u16((ushort)wy);
+            for (; j + 16 <= len; j += 16) {
+                cv::v_uint16x8 lo = cv::v_add(cv::v_add(cv::v_mul_wrap(cv::v_load_expand(row0 + j), w0), cv::v_mul_wrap(cv::v_load_expand(row1 + j), w1)), half);
+                cv::v_uint16x8 hi = cv::v_add(cv::v_add(cv::v_mul_wrap(cv::v_load_expand(row0 + j + 8), w0), cv::v_mul_wrap(cv::v_load_expand(row1 + j + 8), w1)), half);
+                cv::v_store(line.data() + j, cv::v_pack(cv::v_shr<8>(lo), cv::v_shr<8>(hi)));
+            }
+#endif
+            for (; j < len; j++) {
+                line[j] = (uchar)((row0[j] * (256 - wy) + row1[j] * wy + 128) >> 8);
+            }
+
+            uchar *out = dst.ptr<uchar>(v);
+            int u = 0;
+#if CV_SIMD128
+            // Four columns at a time: each pixel is one unaligned 4-byte load, and the 4th byte
+            // of every pixel is dropped again by v_pack_triplets. The store spills 4 bytes, which
+            // the next group overwrites, so the last group is left to the scalar loop.
+            auto load_px = [&](const int ofs) {
+                unsigned px;
+                std::memcpy(&px, line.data() + ofs, sizeof(px));
+                return px;
+            };
+            const int *x_ofs = table.x_ofs.data();
+            for (; (u + 4) * 3 + 4 <= dst.cols * 3; u += 4) {
+                cv::v_uint32x4 l(load_px(x_ofs[u]), load_px(x_ofs[u + 1]), load_px(x_ofs[u + 2]), load_px(x_ofs[u + 3]));
+                cv::v_uint32x4 r(load_px(x_ofs[u] + 3), load_px(x_ofs[u + 1] + 3), load_px(x_ofs[u + 2] + 3), load_px(x_ofs[u + 3] + 3));
+                cv::v_uint16x8 l_lo, l_hi, r_lo, r_hi, w_lo, w_hi;
+                cv::v_expand(cv::v_reinterpret_as_u8(l), l_lo, l_hi);
+                cv::v_expand(cv::v_reinterpret_as_u8(r), r_lo, r_hi);
+                cv::v_expand(cv::v_load(table.x_w.data() + u * 4), w_lo, w_hi);
+                cv::v_uint16x8 lo = cv::v_add(cv::v_add(cv::v_mul_wrap(l_lo, cv::v_sub(full, w_lo)), cv::v_mul_wrap(r_lo, w_lo)), half);
+                cv::v_uint16x8 hi = cv::v_add(cv::v_add(cv::v_mul_wrap(l_hi, cv::v_sub(full, w_hi)), cv::v_mul_wrap(r_hi, w_hi)), half);
+                cv::v_store(out + u * 3, cv::v_pack_triplets(cv::v_pack(cv::v_shr<8>(lo), cv::v_shr<8>(hi))));
+            }
+#endif
+            for (; u < dst.cols; u++) {
+                const uchar *px = line.data() + table.x_ofs[u];
+                const int wx = table.x_w[u * 4];
+                out[u * 3] = (uchar)((px[0] * (256 - wx) + px[3] * wx + 128) >> 8);
+                out[u * 3 + 1] = (uchar)((px[1] * (256 - wx) + px[4] * wx + 128) >> 8);
+                out[u * 3 + 2] = (uchar)((px[2] * (256 - wx) + px[5] * wx + 128) >> 8);
+            }
+        }
+    });
+}
+
+// ===== PLANNING =====
+// Builds the frame timeline from page sizes and image headers, nothing is rasterized or decoded.
+// Also resolves a 0 resolution from the first page, and its pages are the loading tasks.
+Plan build_plan(Config &conf) {
+    Plan plan = {{}, 0, 0.0, {}, 0, 0.0};
+    const std::vector<std::string> input_paths = conf.get_input_paths();
+    const std::vector<std::string> input_types = conf.get_input_types();
+
+    for (size_t i = 0; i < input_paths.size(); i++) {
+        if (input_types[i] == "pdf") {
+            add_pdf_plan(input_paths[i], plan.pages, conf);
+        } else if (input_types[i] == "dir") {
+            add_dir_plan(input_paths[i], plan.pages, conf);
+        }
+    }
+
+    // Gif frames all share the size of the gif
+    std::vector<cv::Size> sizes;
+    for (const PagePlan &page : plan.pages) {
+        for (int c = 0; c < page.count; c++) {
+            sizes.push_back(cv::Size(page.width, page.height));
+        }
+    }
+    plan_timeline(plan, sizes, conf);
+
+    return plan;
+}
+// Sizes are per image in page order, so they must add up to the pages' counts
+void plan_timeline(Plan &plan, const std::vector<cv::Size> &sizes, Config &conf) {
+    plan.image_count = sizes.size();
+    plan.px_per_frame = 0.0;
+    plan.image_frames.clear();
+    if (sizes.size() == 0) {
+        plan.total_frames = 0;
+        plan.duration = 0.0;
+        return;
+    }
+
+    if (conf.get_style() == FRAMES) {
+        plan.image_frames.assign(sizes.size(), 1);
+    } else if (conf.get_style() == KENBURNS) {
+        plan.image_frames.assign(sizes.size(), get_ken_burns_frames(sizes.size(), conf));
+    } else if (conf.get_style() == UP || conf.get_style() == DOWN) {
+        std::vector<int> heights;
+        for (const cv::Size &size : sizes) {
+            heights.push_back(size.height);
+        }
+        plan.px_per_frame = get_pixels_per_frame(sizes, conf);
+        plan.image_frames = count_scroll_frames(heights, conf.get_height(), plan.px_per_frame);
+    } else if (conf.get_style() == LEFT || conf.get_style() == RIGHT) {
+        std::vector<int> widths;
+        for (const cv::Size &size : sizes) {
+            widths.push_back(size.width);
+        }
+        plan.px_per_frame = get_pixels_per_frame(sizes, conf);
+        plan.image_frames = count_scroll_frames(widths, conf.get_width(), plan.px_per_frame);
+    }
+
+    // Each page owns the frames of its images
+    size_t image = 0;
+    plan.total_frames = 0;
+    for (PagePlan &page : plan.pages) {
+        page.first_frame = plan.total_frames;
+        page.frames = 0;
+        for (int c = 0; c < page.count; c++) {
+            page.frames += plan.image_frames[image++];
+        }
+        plan.total_frames += page.frames;
+    }
+    plan.duration = plan.total_frames / conf.get_fps();
+}
+
+// Numbered files in order, nested pdfs are expanded to their pages
+void add_dir_plan(const std::string dir_path, std::vector<PagePlan> &pages, Config &conf) {
+    std::vector<std::string> img_paths = get_dir_img_paths(dir_path);
+    if (conf.get_is_reverse()) {
+        std::reverse(img_paths.begin(), img_paths.end());
+    }
+
+    for (const std::string &path : img_paths) {
+        if ((int)path.find(".pdf") != -1) {
+            add_pdf_plan(path, pages, conf);
+            continue;
+        }
+
+        if ((int)path.find(".gif") != -1) {
+            if (!conf.get_render_gifs()) {
+                std::cout << "Note: '" << path << "' skipped. Use --gif to render gif files as support is limited." << std::endl;
+                continue;
+            }
+            cv::VideoCapture cap(path);
+            if (!cap.isOpened()) {
+                continue;
+            }
+            cv::Size size((int)cap.get(cv::CAP_PROP_FRAME_WIDTH), (int)cap.get(cv::CAP_PROP_FRAME_HEIGHT));
+            int count = std::max(1, (int)cap.get(cv::CAP_PROP_FRAME_COUNT));
+            cv::Size scaled = get_scaled_size(size, conf);
+            pages.push_back({path, "gif", 0, scaled.width, scaled.height, count, 0, 0});
+            continue;
+        }
+
+        cv::Size size = read_image_size(path);
+        if (size.empty()) {
+            std::cerr << "<!> '" << path << "' could not be read. Skipped." << std::endl;
+            continue;
+        }
+        // Updates resolution to first image. Decoded once so the size matches load_image(),
+        // after exif orientation and trimming.
+        if (pages.size() == 0 && (conf.get_width() == 0 || conf.get_height() == 0)) {
+            cv::Mat mat = cv::imread(path);
+            if (!mat.empty()) {
+                size = conf.get_trim() ? find_content_rect(mat).size() : mat.size();
+            }
+            if (conf.get_width() == 0) {
+                conf.set_width(size.width);
+            }
+            if (conf.get_height() == 0) {
+                conf.set_height(size.height);
+            }
+        }
+        cv::Size scaled = get_scaled_size(size, conf);
+        pages.push_back({path, "img", 0, scaled.width, scaled.height, 1, 0, 0});
+    }
+}
+
+// Page sizes come from the rotated page_rect() at the dpi load_pdf_page() would render at
+void add_pdf_plan(const std::string pdf_path, std::vector<PagePlan> &pages, Config &conf) {
+    poppler::document *pdf = poppler::document::load_from_file(pdf_path);
+    if (pdf == nullptr) {
+        std::cerr << "<!> Error: Could not open '" << pdf_path << "'." << std::endl;
+        exit(1);
+    }
+
+    for (int pg = 0; pg < pdf->pages(); pg++) {
+        double dpi = DEFAULT_DPI;
+        poppler::page *page = pdf->create_page(pg);
+        poppler::rectf rect = get_rotated_page_rect(page, poppler::crop_box);
+
+        // Updates resolution to first image
+        if (pages.size() == 0 && (conf.get_width() == 0 || conf.get_height() == 0)) {
+            if (conf.get_width() == 0) {
+                conf.set_width(rect.width());
+            }
+            if (conf.get_height() == 0) {
+                conf.set_height(rect.height());
+            }
+        }
+
+        dpi = get_scaled_dpi(get_rotated_page_rect(page, poppler::media_box), conf);
+
+        // Poppler rounds the page size at the render dpi to whole pixels
+        int width = (int)(rect.width() * dpi / DEFAULT_DPI + 0.5);
+        int height = (int)(rect.height() * dpi / DEFAULT_DPI + 0.5);
+        pages.push_back({pdf_path, "pdf", pg, width, height, 1, 0, 0});
+        delete page;
+    }
+    delete pdf;
+}
+
+// Reads width and height from png, jpeg, bmp and gif headers. Other formats get decoded.
+cv::Size read_image_size(const std::string img_path) {
+    std::ifstream file(img_path, std::ios::binary);
+    unsigned char head[26] = {0};
+    file.read(reinterpret_cast<char *>(head), sizeof(head));
+    if (file.gcount() < (std::streamsize)sizeof(head)) {
+        return cv::Mat(cv::imread(img_path)).size();
+    }
+
+    auto be16 = [](const unsigned char *p) { return (p[0] << 8) | p[1]; };
+    auto be32 = [](const unsigned char *p) { return (int)(((unsigned)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]); };
+    auto le16 = [](const unsigned char *p) { return p[0] | (p[1] << 8); };
+    auto le32 = [](const unsigned char *p) { return (int)(p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned)p[3] << 24)); };
+
+    // PNG: IHDR is always the first chunk
+    if (head[0] == 0x89 && head[1] == 'P' && head[2] == 'N' && head[3] == 'G') {
+        return cv::Size(be32(head + 16), be32(head + 20));
+    }
+    // GIF: logical screen size
+    if (head[0] == 'G' && head[1] == 'I' && head[2] == 'F') {
+        return cv::Size(le16(head + 6), le16(head + 8));
+    }
+    // BMP: height is negative for top-down bitmaps
+    if (head[0] == 'B' && head[1] == 'M') {
+        return cv::Size(le32(head + 18), std::abs(le32(head + 22)));
+    }
+    // JPEG: walk the markers until a start-of-frame segment
+    if (head[0] == 0xFF && head[1] == 0xD8) {
+        file.clear();
+        file.seekg(2);
+        unsigned char seg[9];
+        int orientation = 1;
+        while (file.read(reinterpret_cast<char *>(seg), 4)) {
+            if (seg[0] != 0xFF) {
+                break;
+            }
+            int marker = seg[1];
+            int length = be16(seg + 2);
+            bool is_sof = marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC;
+            if (is_sof) {
+                if (!file.read(reinterpret_cast<char *>(seg + 4), 5)) {
+                    break;
+                }
+                // cv::imread applies exif orientation, 5-8 rotate by 90 degrees
+                if (orientation >= 5 && orientation <= 8) {
+                    return cv::Size(be16(seg + 5), be16(seg + 7));
+                }
+                return cv::Size(be16(seg + 7), be16(seg + 5));
+            }
+            if (marker == 0xE1 && length > 2) {
+                std::vector<unsigned char> app1(length - 2);
+                if (!file.read(reinterpret_cast<char *>(app1.data()), app1.size())) {
+                    break;
+                }
+                // Xmp and other APP1 segments keep the orientation found so far
+                int exif_orientation = read_exif_orientation(app1);
+                if (exif_orientation != 0) {
+                    orientation = exif_orientation;
+                }
+                continue;
+            }
+            file.seekg(length - 2, std::ios::cur);
+        }
+    }
+
+    return cv::Mat(cv::imread(img_path)).size();
+}
+
+// Returns the Orientation tag from an APP1 segment's IFD0, 1 if it has none, 0 if the segment is not exif
+int read_exif_orientation(const std::vector<unsigned char> &app1) {
+    if (app1.size() < 14 || std::string(app1.begin(), app1.begin() + 6) != std::string("Exif\0\0", 6)) {
+        return 0;
+    }
+    const unsigned char *tiff = app1.data() + 6;
+    const size_t size = app1.size() - 6;
+    const bool is_le = tiff[0] == 'I' && tiff[1] == 'I';
+    auto u16 = [&](const size_t ofs) { return is_le ? tiff[ofs] | (tiff[ofs + 1] << 8) : (tiff[ofs] << 8) | tiff[ofs + 1]; };
+    auto u32 = [&](const size_t ofs) {
+        return is_le ? (size_t)tiff[ofs] | ((size_t)tiff[ofs + 1] << 8) | ((size_t)tiff[ofs + 2] << 16) | ((size_t)tiff[ofs + 3] << 24)
+                     : ((size_t)tiff[ofs] << 24) | ((size_t)tiff[ofs + 1] << 16) | ((size_t)tiff[ofs + 2] << 8) | (size_t)tiff[ofs + 3];
+    };
+
+    size_t ifd = u32(4);
+    if (ifd + 2 > size) {
+        return 1;
+    }
+    int entries = u16(ifd);
+    for (int e = 0; e < entries; e++) {
+        size_t entry = ifd + 2 + e * 12;
+        if (entry + 12 > size) {
+            break;
+        }
+        if (u16(entry) == 0x0112) {
+            return u16(entry + 8);
+        }
+    }
+    return 1;
+}
+
+// Mirrors the scale picked by scale_image()
+cv::Size get_scaled_size(const cv::Size size, Config &conf) {
+    double scale = 1.0;
+    if (conf.get_style() == FRAMES) {
+        double scale_w = (double)conf.get_width() / (double)size.width;
+        double scale_h = (double)conf.get_height() / (double)size.height;
+        if (size.width > conf.get_width() && size.width > conf.get_height()) {
+            scale = std::min(scale_w, scale_h);
+        } else if (size.width < conf.get_width() && size.height < conf.get_height()) {
+            scale = std::min(scale_w, scale_h);
+        } else if (size.width > conf.get_width() && size.height <= conf.get_height()) {
+            scale = scale_w;
+        } else if (size.width <= conf.get_width() && size.height > conf.get_height()) {
+            scale = scale_h;
+        }
+    } else if (conf.get_style() == KENBURNS) {
+        scale = std::max((double)conf.get_width() / (double)size.width, (double)conf.get_height() / (double)size.height) * KB_MAX_ZOOM;
+    } else if (conf.get_style() == UP || conf.get_style() == DOWN) {
+        scale = (double)conf.get_width() / (double)size.width;
+    } else if (conf.get_style() == LEFT || conf.get_style() == RIGHT) {
+        scale = (double)conf.get_height() / (double)size.height;
+    }
+    return cv::Size((int)std::round(size.width * scale), (int)std::round(size.height * scale));
+}
+
+// Replays the scroll renderers' buffer arithmetic to count the frames written after each image is placed
+std::vector<size_t> count_scroll_frames(const std::vector<int> &lengths, const int vp_length, const double px_per_frame) {
+    std::vector<size_t> frames(lengths.size(), 0);
+    double pos = 0.0;
+    double dst_length = vp_length + lengths[0];
+    for (size_t i = 0; i < lengths.size(); i++) {
+        if (i != 0) {
+            double unused_length = dst_length - (pos + vp_length);
+            double new_dst_length = vp_length + unused_length + lengths[i];
+            if (lengths.size() - 1 == i) {
+                dst_length = (int)(vp_length + std::ceil(new_dst_length) + px_per_frame);
+            } else {
+                dst_length = (int)std::ceil(new_dst_length);
+            }
+            pos = 0.0;
+        }
+        while ((dst_length - (pos + vp_length)) > px_per_frame) {
+            frames[i]++;
+            pos += px_per_frame;
+        }
+    }
+    return frames;
+}
+
+void print_plan(const Plan &plan, Config &conf) {
+    size_t gap = 20;
+    size_t pdf_pages = 0;
+    size_t loaded_bytes = 0;
+    for (const PagePlan &page : plan.pages) {
+        pdf_pages += page.type == "pdf" ? 1 : 0;
+        loaded_bytes += (size_t)page.width * page.height * 3 * page.count;
+    }
+    size_t frame_px = 0;
+    for (const Rendition &rend : conf.get_renditions()) {
+        frame_px += (size_t)rend.width * rend.height;
+    }
+    double encoded_px = (double)frame_px * plan.total_frames;
+
+    std::cout << "\n" << COLOR_BOLD << "Plan" << COLOR_RESET << "\n";
+    std::cout << std::left << std::setw(gap) << "  Images" << plan.image_count << COLOR_DIM << " (" << pdf_pages << " pdf pages)" << COLOR_RESET << "\n";
+    if (conf.get_style() != FRAMES && conf.get_style() != KENBURNS) {
+        std::cout << std::left << std::setw(gap) << "  Px/Frame" << std::fixed << std::setprecision(2) << plan.px_per_frame << "\n";
+    }
+    std::cout << std::left << std::setw(gap) << "  Frames" << plan.total_frames << (conf.get_trim() ? COLOR_DIM " (before --trim)" COLOR_RESET : "") << "\n";
+    std::cout << std::left << std::setw(gap) << "  Video Length" << std::fixed << std::setprecision(2) << plan.duration << "s\n";
+    std::cout << std::left << std::setw(gap) << "  Encoded Pixels" << std::setprecision(1) << encoded_px / 1.0e6 << " Mpx\n";
+    std::cout << std::left << std::setw(gap) << "  Loaded Images" << std::setprecision(1) << loaded_bytes / (1024.0 * 1024.0) << " MiB\n";
+    std::cout << std::left << std::setw(gap) << "  Est. Encode Time" << "~" << std::setprecision(1) << encoded_px / EST_ENCODE_PX_PER_SEC << "s\n";
+    std::cout << std::defaultfloat;
+}
+
 // ==== HELPER FUNCTIONS ====
-double get_pixels_per_frame(const std::vector<cv::Mat> &imgs, Config &conf) {
+
+double get_pixels_per_frame(const std::vector<cv::Size> &sizes, Config &conf) {
     // Find px_per_frame
     double px_per_frame = 1.0;
 
     if (conf.get_style() == UP || conf.get_style() == DOWN) {
         int height_of_imgs = 0;
-        for (size_t i = 0; i < imgs.size(); i++) {
-            height_of_imgs += imgs[i].size().height;
+        for (size_t i = 0; i < sizes.size(); i++) {
+            height_of_imgs += sizes[i].height;
         }
         if (conf.get_duration() == 0) {
-            px_per_frame += height_of_imgs / (conf.get_fps() * conf.get_spp() * imgs.size());
+            px_per_frame += height_of_imgs / (conf.get_fps() * conf.get_spp() * sizes.size());
         } else {
             px_per_frame = height_of_imgs / (conf.get_fps() * conf.get_duration());
         }
     } else if (conf.get_style() == LEFT || conf.get_style() == RIGHT) {
         int width_of_imgs = 0;
-        for (size_t i = 0; i < imgs.size(); i++) {
-            width_of_imgs += imgs[i].size().width;
+        for (size_t i = 0; i < sizes.size(); i++) {
+            width_of_imgs += sizes[i].width;
         }
         if (conf.get_duration() == 0) {
-            px_per_frame += width_of_imgs / (conf.get_fps() * conf.get_spp() * imgs.size());
+            px_per_frame += width_of_imgs / (conf.get_fps() * conf.get_spp() * sizes.size());
         } else {
             px_per_frame = width_of_imgs / (conf.get_fps() * conf.get_duration());
         }
@@ -631,6 +2208,109 @@ void print_duration(const time_t start_time) {
                << "Done in " << minutes << "m " << seconds << "s" << std::endl;
 }
 
+void print_pipeline_stalls(const double compositor_stall, const double encoder_stall) {
+    const char *bottleneck = compositor_stall > encoder_stall ? "encoding" : "compositing";
+    std::cout << COLOR_DIM << "  Compositor waited " << std::fixed << std::setprecision(2) << compositor_stall
+              << "s for free frames, encoder waited " << encoder_stall << "s for new frames ("
+              << bottleneck << " bound)" << COLOR_RESET << std::defaultfloat << std::endl;
+}
+
+// "out/doc.m3u8" -> "out/doc.ts"
+std::string get_stream_path(const std::string playlist_path) {
+    return playlist_path.substr(0, playlist_path.size() - std::string(HLS_PLAYLIST).size()) + HLS_SEGMENT;
+}
+
+// "out/doc.m3u8" -> "out/doc_master.m3u8"
+std::string get_master_playlist_path(const std::string playlist_path) {
+    return playlist_path.substr(0, playlist_path.size() - std::string(HLS_PLAYLIST).size()) + "_master" + HLS_PLAYLIST;
+}
+
+// Parses the packets the writer has flushed since the last call. A segment is closed at the first
+// keyframe on or after each multiple of segment_frames, so every segment decodes on its own.
+// Returns true when a segment was closed.
+bool scan_ts_segments(const std::string stream_path, TsScan &scan, const int segment_frames, const double fps) {
+    std::ifstream file(stream_path, std::ios::binary);
+    file.seekg(scan.offset);
+    const size_t closed = scan.segments.size();
+    unsigned char pkt[TS_PACKET_SIZE];
+    while (file.read(reinterpret_cast<char *>(pkt), TS_PACKET_SIZE)) {
+        const size_t at = scan.offset;
+        scan.offset += TS_PACKET_SIZE;
+        const bool is_unit_start = (pkt[1] & 0x40) != 0;
+        const int pid = ((pkt[1] & 0x1F) << 8) | pkt[2];
+        const bool has_adaptation = (pkt[3] & 0x20) != 0;
+        const size_t payload = has_adaptation ? 5 + pkt[4] : 4;
+        if (pkt[0] != 0x47 || !is_unit_start || payload >= TS_PACKET_SIZE) {
+            continue;
+        }
+
+        // Tables start after a pointer field. The PAT gives the PMT, the PMT's first stream is the video.
+        const size_t table = payload + 1 + pkt[payload];
+        if (pid == 0) {
+            if (table + 12 <= TS_PACKET_SIZE) {
+                scan.pmt_pid = ((pkt[table + 10] & 0x1F) << 8) | pkt[table + 11];
+            }
+            scan.last_pat = at;
+            scan.pat_frame = scan.frames;
+        } else if (pid == scan.pmt_pid && scan.video_pid < 0) {
+            if (table + 12 <= TS_PACKET_SIZE) {
+                size_t stream = table + 12 + (((pkt[table + 10] & 0x0F) << 8) | pkt[table + 11]);
+                if (stream + 3 <= TS_PACKET_SIZE) {
+                    scan.video_pid = ((pkt[stream + 1] & 0x1F) << 8) | pkt[stream + 2];
+                }
+            }
+        } else if (pid == scan.video_pid) {
+            // ffmpeg flags keyframes with random_access_indicator and repeats PAT/PMT right before them
+            const bool is_key = has_adaptation && pkt[4] > 0 && (pkt[5] & 0x40) != 0;
+            if (is_key && scan.frames > 0 && scan.frames >= (scan.segments.size() + 1) * (size_t)segment_frames) {
+                size_t start = scan.pat_frame == scan.frames ? scan.last_pat : at;
+                scan.segments.push_back({scan.segment_offset, start - scan.segment_offset, (scan.frames - scan.segment_frame) / fps});
+                scan.segment_offset = start;
+                scan.segment_frame = scan.frames;
+            }
+            scan.frames++;
+        }
+    }
+    return scan.segments.size() > closed;
+}
+
+// Rewritten after every segment. Written to a temp file and renamed so players never read half a playlist.
+// Segments are byte ranges of one continuous encode, so timestamps run on without discontinuities.
+// An EVENT playlist may only grow, so the type and target duration stay fixed and finishing just appends ENDLIST.
+void write_media_playlist(const std::string playlist_path, const std::vector<HlsSegment> &segments, const int target_duration,
+                          const bool is_final) {
+    const std::string stream_name = std::filesystem::path(get_stream_path(playlist_path)).filename().string();
+    std::string tmp_path = playlist_path + ".tmp";
+    std::ofstream file(tmp_path);
+    file << "#EXTM3U\n"
+         << "#EXT-X-VERSION:4\n"
+         << "#EXT-X-TARGETDURATION:" << target_duration << "\n"
+         << "#EXT-X-MEDIA-SEQUENCE:0\n"
+         << "#EXT-X-PLAYLIST-TYPE:EVENT\n";
+    for (const HlsSegment &segment : segments) {
+        file << "#EXTINF:" << std::fixed << std::setprecision(3) << segment.duration << ",\n"
+             << "#EXT-X-BYTERANGE:" << segment.length << "@" << segment.offset << "\n"
+             << stream_name << "\n";
+    }
+    if (is_final) {
+        file << "#EXT-X-ENDLIST\n";
+    }
+    file.close();
+    std::filesystem::rename(tmp_path, playlist_path);
+}
+
+void write_master_playlist(const std::string master_path, const std::vector<Rendition> &renditions, const double fps) {
+    std::filesystem::path master_dir = std::filesystem::absolute(master_path).parent_path();
+    std::ofstream file(master_path);
+    file << "#EXTM3U\n"
+         << "#EXT-X-VERSION:3\n";
+    for (const Rendition &rend : renditions) {
+        file << "#EXT-X-STREAM-INF:BANDWIDTH=" << (long)(rend.width * rend.height * fps * HLS_BITS_PER_PIXEL)
+             << ",RESOLUTION=" << rend.width << "x" << rend.height << "\n"
+             << std::filesystem::relative(std::filesystem::absolute(rend.output), master_dir).string() << "\n";
+    }
+}
+
 void print_banner(const std::string &title) {
     int width = static_cast<int>(title.size()) + 4;
     std::cout << "\u250C";
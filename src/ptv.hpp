@@ -2,13 +2,19 @@
 #define PTV_HPP
 
 // std
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 // cv
 #include <opencv2/core/persistence.hpp>
 #include <opencv2/imgcodecs.hpp>
 #include <opencv2/core.hpp>
 #include <opencv2/core/hal/interface.h>
+#include <opencv2/core/hal/intrin.hpp>
 #include <opencv2/core/types.hpp>
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgcodecs.hpp>
@@ -40,8 +46,21 @@ namespace ptv {
 #define DOWN "DOWN"
 #define LEFT "LEFT"
 #define RIGHT "RIGHT"
+#define KENBURNS "KENBURNS"
 
 #define DEFAULT_DPI 72.0f
+#define HLS_PLAYLIST ".m3u8"
+#define HLS_SEGMENT ".ts"
+#define HLS_GOP_FRAMES 12 // cv::VideoWriter's ffmpeg backend starts a new gop at least this often
+#define TS_PACKET_SIZE 188
+#define HLS_SEGMENT_SECONDS 4.0f // default when the output is a .m3u8 without --hls
+#define HLS_BITS_PER_PIXEL 0.1 // bandwidth advertised in the master playlist
+#define TRIM_PROBE_DPI 24.0 // low dpi render used to find a page's content box
+#define TRIM_THRESHOLD 24    // gray levels a pixel must differ from the background to count as content
+#define TRIM_PADDING 0.01    // margin kept around the content, fraction of the page size
+#define FRAME_RING_SIZE 4 // frames the compositor can get ahead of the encoder
+#define KB_MAX_ZOOM 1.25 // ken burns zooms between 1x and this, pages load at this scale
+#define EST_ENCODE_PX_PER_SEC 120.0e6 // rough h264 throughput used by --dry-run estimates
 
 }
 const std::string HELP_TXT =
@@ -55,34 +74,72 @@ const std::string HELP_TXT =
 
     COLOR_BOLD "Options:\n" COLOR_RESET
     "  " COLOR_CYAN "-r <int>x<int>" COLOR_RESET "            Output resolution. 0 preserves original. " COLOR_DIM "(default: 1280x720)" COLOR_RESET "\n"
+    "  " COLOR_DIM "                          Repeat -r (and -o) to render several resolutions in one pass." COLOR_RESET "\n"
     "  " COLOR_CYAN "-f <float>" COLOR_RESET "                Frames per second.\n"
     "  " COLOR_CYAN "-s <float>" COLOR_RESET "                Seconds per frame.\n"
     "  " COLOR_CYAN "-d <float>" COLOR_RESET "                Duration of video in seconds. " COLOR_DIM "(overrides -s)" COLOR_RESET "\n"
     "  " COLOR_CYAN "-o <output_path>" COLOR_RESET "          Output file path. " COLOR_DIM "(.mp4 only, auto-named if blank)" COLOR_RESET "\n"
+    "  " COLOR_CYAN "--hls <float>" COLOR_RESET "             Write <float> second segments and a live .m3u8 playlist instead of one .mp4.\n"
     "  " COLOR_CYAN "-a <Up|Down|Left|Right>" COLOR_RESET "   Scroll content continuously instead of per-page frames.\n"
+    "  " COLOR_CYAN "-a KenBurns" COLOR_RESET "               Slowly pan and zoom over each page for -s seconds.\n"
     "  " COLOR_CYAN "--gif" COLOR_RESET "                     Render .gif files found in image sequences.\n"
     "  " COLOR_CYAN "--rev-seq" COLOR_RESET "                 Load numbered images in descending order.\n"
+    "  " COLOR_CYAN "--trim" COLOR_RESET "                    Crop blank margins before scaling, content fills more of the frame.\n"
+    "  " COLOR_CYAN "--no-passthrough" COLOR_RESET "          Always rasterize pdf pages, even full-page jpeg scans.\n"
+    "  " COLOR_CYAN "--dry-run" COLOR_RESET "                 Print the frame timeline and cost estimate without rendering.\n"
     "  " COLOR_CYAN "-h, --help" COLOR_RESET "                Show this help text.\n\n"
 
     COLOR_BOLD "Examples:\n" COLOR_RESET
     "  " COLOR_DIM "ptv slides.pdf -r 1920x1080 -f 30 -s 2" COLOR_RESET "\n"
-    "  " COLOR_DIM "ptv frames/ -a Up -f 60 -o output.mp4" COLOR_RESET "\n";
+    "  " COLOR_DIM "ptv frames/ -a Up -f 60 -o output.mp4" COLOR_RESET "\n"
+    "  " COLOR_DIM "ptv slides.pdf -r 1920x1080 -o hd.mp4 -r 1280x720 -o sd.mp4" COLOR_RESET "\n";
+
+struct Rendition {
+    int width;
+    int height;
+    std::string output;
+};
+
+// Byte range of one rendition's .ts that is listed as a media segment
+struct HlsSegment {
+    size_t offset;
+    size_t length;
+    double duration;
+};
+
+// Keyframes found so far in a .ts that is still being written, see scan_ts_segments()
+struct TsScan {
+    size_t offset = 0;         // whole packets parsed so far
+    int pmt_pid = -1;
+    int video_pid = -1;
+    size_t last_pat = 0;       // offset of the latest PAT packet
+    size_t pat_frame = 0;      // frames started before that PAT
+    size_t frames = 0;         // video frames started so far, in decode order
+    size_t segment_offset = 0; // start of the open segment
+    size_t segment_frame = 0;  // first frame of the open segment
+    std::vector<HlsSegment> segments;
+};
 
 class Config {
     private:
         bool render_gifs_;
         bool is_reverse_;
+        bool is_dry_run_;
+        bool use_passthrough_;
+        bool is_trim_;
         int width_;
         int height_;
         float fps_;
         float spp_;
         float duration_;
+        float segment_seconds_; // 0 unless writing hls
         std::string style_;
         std::string output_;
         std::string container_;
         std::string codec_;
         std::vector<std::string> input_paths_;
         std::vector<std::string> input_types_;
+        std::vector<Rendition> ladder_; // extra renditions, smaller than the primary width_ x height_ output
     public:
         Config(int argc, char **argv);
         // Setters
@@ -93,48 +150,171 @@ class Config {
         // Getters
         bool get_render_gifs();
         bool get_is_reverse();
+        bool get_is_dry_run();
+        bool get_use_passthrough();
+        bool get_trim();
         int get_width();
         int get_height();
         float get_fps();
         float get_spp();
         float get_duration();
+        float get_segment_seconds();
         std::string get_style();
         std::string get_output();
         std::string get_codec();
         std::vector<std::string> get_input_paths();
         std::vector<std::string> get_input_types();
+        std::vector<Rendition> get_renditions(); // primary rendition first, then ladder_ in descending size
+};
+
+// Encodes frames on its own thread. Renderers compose into a ring of preallocated frames
+// with acquire_frame()/submit_frame() and only block when the ring is full.
+// Smaller renditions are downscaled from the next larger one.
+// For hls each rendition is one continuous .ts. Its playlist lists byte ranges of it, and is
+// rewritten whenever the encoder has flushed the keyframe that closes the next segment.
+class VideoOutput {
+    private:
+        std::vector<Rendition> renditions_;
+        std::vector<cv::VideoWriter> writers_;
+        int fourcc_;
+        double fps_;
+        int segment_frames_; // 0 unless writing hls
+        size_t frame_count_;
+        std::vector<TsScan> scans_; // one per rendition when writing hls
+        std::vector<cv::Mat> frames_; // renditions of the frame being encoded
+        std::vector<cv::Mat> ring_;
+        size_t head_;  // next slot the compositor fills
+        size_t tail_;  // next slot the encoder reads
+        size_t count_; // submitted slots not yet encoded
+        bool is_done_;
+        double compositor_stall_; // seconds waiting for a free slot
+        double encoder_stall_;    // seconds waiting for a submitted slot
+        std::mutex mutex_;
+        std::condition_variable not_full_;
+        std::condition_variable not_empty_;
+        std::thread encoder_;
+        void encode_loop();
+        void encode(const cv::Mat &frame);
+        void open_writer(const size_t rendition);
+        void finish_segments();
+        int get_target_duration();
+    public:
+        VideoOutput(Config &conf);
+        ~VideoOutput();
+        cv::Mat &acquire_frame(); // primary-size CV_8UC3 frame owned by the caller until submit_frame()
+        void submit_frame();
+        void release(); // encodes remaining frames and closes the files
+        double get_compositor_stall();
+        double get_encoder_stall();
+};
+
+// Size of one loaded page or image, known before anything is decoded
+struct PagePlan {
+    std::string path;
+    std::string type; // "pdf", "img" or "gif"
+    int page;         // page index for pdfs
+    int width;        // size after scaling to the viewport
+    int height;
+    int count;        // images produced, more than 1 for gifs
+    size_t first_frame; // frames rendered from the moment this page is placed, see plan_timeline()
+    size_t frames;
+};
+
+struct Plan {
+    std::vector<PagePlan> pages;
+    size_t image_count;
+    double px_per_frame;
+    std::vector<size_t> image_frames; // frames per image, in load order
+    size_t total_frames;
+    double duration;
+};
+
+// Jpeg stream that fills a whole pdf page, see find_page_jpegs()
+struct PageJpeg {
+    size_t offset; // stream data position in the pdf file
+    size_t length; // 0 when the page has to be rasterized
+    int width;
+    int height;
+};
+
+// Fixed-point bilinear sampling table for one ken burns frame.
+// Separable because the camera only pans and zooms.
+struct KenBurnsTable {
+    int x_start;              // byte offset of the leftmost source pixel read in every row
+    std::vector<int> x_ofs;   // byte offset of the left source pixel per output column, from x_start
+    std::vector<uchar> x_w;   // weight of the right pixel, out of 256, repeated 4 times per column
+    std::vector<int> y_row;   // top source row per output row
+    std::vector<uchar> y_w;   // weight of the bottom row, out of 256
 };
 
 // HELPER
 void scale_image_to_width(cv::Mat &img, const int dst_width);
 void scale_image_to_height(cv::Mat &img, const int dst_height);
 void scale_image_to_fit(cv::Mat& img, Config &conf);
+void scale_image_to_cover(cv::Mat &img, Config &conf); // fills the viewport at KB_MAX_ZOOM
 void scale_image(cv::Mat &img, Config &conf);
 
-double get_scaled_dpi_from_width(const poppler::page *page, const int width); // dpi fits page width to vp width
-double get_scaled_dpi_from_height(const poppler::page *page, const int height); // dpi fits page height to vp height
-double get_scaled_dpi_to_fit(poppler::page *page, Config &conf); // dpi fits entire page in viewport
+double get_scaled_dpi_from_width(const poppler::rectf &rect, const int width); // dpi fits page width to vp width
+double get_scaled_dpi_from_height(const poppler::rectf &rect, const int height); // dpi fits page height to vp height
+double get_scaled_dpi_to_fit(const poppler::rectf &rect, Config &conf); // dpi fits entire page in viewport
+double get_scaled_dpi_to_cover(const poppler::rectf &rect, Config &conf); // dpi fills viewport at KB_MAX_ZOOM
+double get_scaled_dpi(const poppler::rectf &rect, Config &conf); // picks one of the above for the animation style
+
+cv::Rect find_content_rect(const cv::Mat &img); // box around non-background pixels
+poppler::rectf get_rotated_page_rect(const poppler::page *page, const poppler::page_box_enum box); // page size as rendered
+poppler::rectf get_content_rect(const cv::Mat &probe, const poppler::rectf &page_rect); // same box in page points
 
 std::vector<std::string> get_dir_img_paths(std::string dir_path);
 
-double get_pixels_per_frame(const std::vector<cv::Mat> &imgs, Config &conf);
+double get_pixels_per_frame(const std::vector<cv::Size> &sizes, Config &conf);
+
+// PLANNING
+Plan build_plan(Config &conf);
+void plan_timeline(Plan &plan, const std::vector<cv::Size> &sizes, Config &conf); // frame ranges from per-image sizes
+void add_dir_plan(const std::string dir_path, std::vector<PagePlan> &pages, Config &conf);
+void add_pdf_plan(const std::string pdf_path, std::vector<PagePlan> &pages, Config &conf);
+cv::Size read_image_size(const std::string img_path); // reads dimensions from the file header only
+int read_exif_orientation(const std::vector<unsigned char> &app1);
+cv::Size get_scaled_size(const cv::Size size, Config &conf); // size scale_image() would produce
+std::vector<size_t> count_scroll_frames(const std::vector<int> &lengths, const int vp_length, const double px_per_frame);
+void print_plan(const Plan &plan, Config &conf);
 
 // LOADING
-void add_dir_images(const std::string dir_path, std::vector<cv::Mat> &vid_images, Config &conf);
-void add_pdf_images(const std::string pdf_path, std::vector<cv::Mat> &vid_images, Config &conf);
+cv::Mat load_image(const std::string img_path, Config &conf);
+cv::Mat load_pdf_page(const poppler::document *pdf, const std::string pdf_path, const int pg, const std::vector<PageJpeg> &jpegs, Config &conf, bool &is_passthrough);
 void add_gif_images(const std::string gif_path, std::vector<cv::Mat> &vid_images, Config &conf);
+std::vector<cv::Mat> load_plan_images(Plan &plan, Config &conf); // loads every planned page in parallel, in plan order
+void run_work_stealing(const size_t task_count, const size_t worker_count, const std::function<void(const size_t worker, const size_t task)> &run_task);
+cv::Mat poppler_image_to_mat(poppler::image &img);
+
+// PASSTHROUGH
+std::vector<PageJpeg> find_page_jpegs(const std::string pdf_path, const int page_count);
+cv::Mat decode_page_jpeg(const std::string pdf_path, const PageJpeg &jpeg, const cv::Size dst_size);
 
 // RENDERING
-void render_video_sequence(cv::VideoWriter &vid, const std::vector<cv::Mat> &imgs, Config &conf);
-void render_video_scroll_up(cv::VideoWriter &vid, const std::vector<cv::Mat> &imgs, Config &conf);
-// void render_video_scroll_down(cv::VideoWriter &vid, const std::vector<cv::Mat> &imgs, Config &conf);
-void render_video_scroll_left(cv::VideoWriter &vid, const std::vector<cv::Mat> &imgs, Config &conf);
-// void render_video_scroll_right(cv::VideoWriter &vid, const std::vector<cv::Mat> &imgs, Config &conf);
+void render_video_sequence(VideoOutput &vid, const std::vector<cv::Mat> &imgs, Config &conf);
+void render_video_scroll_up(VideoOutput &vid, const std::vector<cv::Mat> &imgs, const Plan &plan, Config &conf);
+// void render_video_scroll_down(VideoOutput &vid, const std::vector<cv::Mat> &imgs, const Plan &plan, Config &conf);
+void render_video_scroll_left(VideoOutput &vid, const std::vector<cv::Mat> &imgs, const Plan &plan, Config &conf);
+// void render_video_scroll_right(VideoOutput &vid, const std::vector<cv::Mat> &imgs, const Plan &plan, Config &conf);
+void render_video_ken_burns(VideoOutput &vid, const std::vector<cv::Mat> &imgs, const Plan &plan, Config &conf);
+
+// KEN BURNS
+int get_ken_burns_frames(const size_t image_count, Config &conf); // frames spent on each page
+KenBurnsTable make_ken_burns_table(const cv::Mat &src, const cv::Rect2d crop, const cv::Size vp_size);
+void remap_bilinear(const cv::Mat &src, cv::Mat &dst, const KenBurnsTable &table);
 
 // MISC
 void print_duration(const time_t start_time);
 void print_progress_bar(const std::string& label, const int current_value, const int total, const bool first_call, const int width = 44);
 void print_banner(const std::string &title);
+std::string get_stream_path(const std::string playlist_path);
+std::string get_master_playlist_path(const std::string playlist_path);
+bool scan_ts_segments(const std::string stream_path, TsScan &scan, const int segment_frames, const double fps);
+void write_media_playlist(const std::string playlist_path, const std::vector<HlsSegment> &segments, const int target_duration,
+                          const bool is_final);
+void write_master_playlist(const std::string master_path, const std::vector<Rendition> &renditions, const double fps);
+void print_pipeline_stalls(const double compositor_stall, const double encoder_stall);
 std::string make_scroll_label(const double px_per_frame);
 
 void set_default_resolution(const std::string path, const std::string type, Config &conf);